@@ -1,3 +1,7 @@
+#if !defined(_WIN32) && !defined(__APPLE__)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,7 +26,20 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <setjmp.h>
 #include <pthread.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #else
 #include <libudev.h>
 #include <sys/stat.h>
@@ -30,17 +47,403 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <setjmp.h>
 #include <pthread.h>
 #include <linux/limits.h>
-#include <mntent.h>
+#include <linux/io_uring.h>
+#include <linux/fs.h>
+#include <dirent.h>
+#include <sched.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#endif
+
+#if !defined(_WIN32) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#elif !defined(_WIN32) && defined(__aarch64__)
+#include <arm_neon.h>
 #endif
 
 #define MAX_RETRIES 3
 #define FILL_BUFFER_SIZE (1024 * 1024)
+#define MAX_IO_SIZE (16 * 1024 * 1024)
+#define MIN_CALIBRATION_IO_SIZE (64 * 1024)
+#define MAX_IO_SIZE_CANDIDATES 12
+#define CALIBRATION_MS 3000
+#define CALIBRATION_BATCH (8 * 1024 * 1024)
+#define ENGINE_PROBE_MS 1500
+#define MAX_ENGINE_CLASSES 64
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+#define DEFAULT_QUEUE_DEPTH 8
+#define MAX_QUEUE_DEPTH 256
+#define ENGINE_UNAVAILABLE 1
+#define OFFLOAD_CHUNK_SIZE (1024LL * 1024 * 1024)
+#define DEFAULT_WORKERS 4
+#define DEFAULT_JOBS_PER_BUS 2
+#define DEFAULT_SETTLE_MS 250
+#define MAX_EVENT_BATCH 1024
+#define MAX_TRACKED_DEVICES 256
+#define DEFAULT_METRICS_INTERVAL 5
+#define DEFAULT_STATE_DIR "/var/lib/storage-cleaner"
+#define CHECKPOINT_INTERVAL (1024LL * 1024 * 1024)
+#define MAX_EXTENTS 4096
+#define DEFAULT_VERIFY_WINDOW_MB 256
+#define DEFAULT_DIRTY_WINDOW_MB 64
+#define DEFAULT_REWIPE_HOURS 24
+#define FINGERPRINT_EDGE (1024 * 1024)
+#define FINGERPRINT_BLOCK 4096
+#define FINGERPRINT_SAMPLES 64
+#define MAX_WIPED_ENTRIES 1024
+#define VERIFY_BUFFER_SIZE (4 * 1024 * 1024)
+#define VERIFY_POLL_MS 20
+#define VERIFY_RECHECK_LIMIT (64LL * 1024 * 1024)
+#define MAX_PASSES 8
+#define SIGNATURE_PROBE_SIZE (64 * 1024)
+#define SIGNATURE_EDGE_SIZE (1024 * 1024)
+#define MAX_SCANNED_PARTITIONS 128
+#define MAX_TARGETS 64
+#define ZERO_REGION_SIZE MAX_IO_SIZE
+#define WRITEV_BATCH_SIZE (64 * 1024 * 1024)
+#define WRITEV_MAX_IOVECS 1024
+#define MMAP_WINDOW_SIZE (64LL * 1024 * 1024)
+#define MAX_RANGES 64
+#define MIN_RANGE_SIZE (4LL * 1024 * 1024 * 1024)
+#define RANGE_POLL_MS 100
+#define THROTTLE_BURST_NS (100 * 1000000LL)
+#define LIMITS_RELOAD_NS (1000 * 1000000LL)
+#define PATTERN_BLOCK_SIZE (64 * 1024)
+#define PATTERN_LANES 4
+#define PATTERN_PRODUCERS 2
+#define PATTERN_LOOKAHEAD 2
+#define LATENCY_BUCKETS 512
+#define EVENT_RING_SIZE 4096
+#define EVENT_POLL_MS 50
+#define MAX_BACKEND_FDS 4096
+#define MAX_SIMULATED_FAILURES 16
+
+enum io_engine_kind {
+    IO_ENGINE_URING,
+    IO_ENGINE_WRITE,
+    IO_ENGINE_MMAP,
+    IO_ENGINE_SPLICE,
+    // Not an engine: picks one of the above per device class.
+    IO_ENGINE_AUTO
+};
+
+enum pattern_kind {
+    PATTERN_ZERO,
+    PATTERN_BYTE,
+    PATTERN_RANDOM
+};
+
+struct wipe_pass {
+    enum pattern_kind kind;
+    unsigned char byte;
+};
+
+struct cleaner_options {
+    enum io_engine_kind engine;
+    unsigned queue_depth;
+    int direct;
+    int offload;
+    unsigned workers;
+    unsigned jobs_per_bus;
+    const char* metrics_file;
+    const char* metrics_socket;
+    unsigned metrics_interval;
+    const char* state_dir;
+    int verify;
+    unsigned long long verify_window;
+    const char* pattern_spec;
+    struct wipe_pass passes[MAX_PASSES];
+    unsigned pass_count;
+    size_t io_size;
+    int fast;
+    unsigned long long max_rate;
+    unsigned long long device_rate;
+    const char* limits_file;
+    int io_class;
+    int io_level;
+    const char* cpu_list;
+    const char* targets[MAX_TARGETS];
+    unsigned target_count;
+    unsigned ranges;
+    const char* simulate;
+    unsigned long long dirty_window;
+    unsigned rewipe_after;
+    unsigned settle_ms;
+    const char* certificate_key;
+};
+
+struct cleaner_options options = {
+    IO_ENGINE_AUTO, DEFAULT_QUEUE_DEPTH, 1, 1, DEFAULT_WORKERS, DEFAULT_JOBS_PER_BUS,
+    NULL, NULL, DEFAULT_METRICS_INTERVAL, DEFAULT_STATE_DIR,
+    0, DEFAULT_VERIFY_WINDOW_MB * 1024ULL * 1024,
+    "zero", { { PATTERN_ZERO, 0 } }, 1, 0, 0,
+    0, 0, NULL, 0, 0, NULL,
+    { NULL }, 0, 1, NULL, DEFAULT_DIRTY_WINDOW_MB * 1024ULL * 1024,
+    DEFAULT_REWIPE_HOURS, DEFAULT_SETTLE_MS, NULL
+};
+
+enum wipe_phase {
+    PHASE_QUEUED,
+    PHASE_PARTITION_ERASE,
+    PHASE_FILL,
+    PHASE_VERIFY,
+    PHASE_DONE,
+    PHASE_FAILED,
+    PHASE_CANCELLED
+};
+
+#ifndef _WIN32
+enum metrics_slot_state {
+    METRICS_SLOT_FREE,
+    METRICS_SLOT_ACTIVE,
+    METRICS_SLOT_RETIRED
+};
+
+// One slot per wipe job. Writers only touch the atomic counters; the
+// sequence is odd while the slot is being handed to a new device so the
+// exporter can skip torn reads of the labels.
+struct wipe_metrics {
+    atomic_int state;
+    atomic_uint sequence;
+    char device[64];
+    char bus[128];
+    atomic_ullong bytes_written;
+    atomic_ullong fill_start_bytes;
+    atomic_ullong total_bytes;
+    atomic_ullong bytes_verified;
+    atomic_uint retries;
+    atomic_uint pass;
+    atomic_ullong io_size;
+    atomic_ullong flush_ns;
+    atomic_int engine;
+    atomic_int phase;
+    atomic_llong phase_started_ms;
+};
+
+struct metrics_snapshot {
+    char device[64];
+    char bus[128];
+    unsigned long long bytes_written;
+    unsigned long long fill_start_bytes;
+    unsigned long long total_bytes;
+    unsigned long long bytes_verified;
+    unsigned retries;
+    unsigned pass;
+    unsigned long long io_size;
+    unsigned long long flush_ns;
+    int engine;
+    int phase;
+    long long phase_started_ms;
+    unsigned sequence;
+};
+
+struct metrics_exporter {
+    int listen_fd;
+    long long last_refresh_ms;
+    struct metrics_snapshot snapshots[MAX_TRACKED_DEVICES];
+    int valid[MAX_TRACKED_DEVICES];
+    double current_mbps[MAX_TRACKED_DEVICES];
+};
+
+long long monotonic_ms();
+long long monotonic_ns();
+int try_claim_metrics(struct wipe_metrics* slot, int expected_state);
+struct wipe_metrics* claim_metrics(const char* device_path, const char* bus, unsigned long long total_bytes);
+void release_metrics(struct wipe_metrics* metrics);
+int snapshot_metrics(int index, struct metrics_snapshot* snapshot);
+void write_metrics_text(FILE* out, struct metrics_exporter* exporter);
+void refresh_metrics(struct metrics_exporter* exporter);
+int write_metrics_file(const char* path, struct metrics_exporter* exporter);
+int open_metrics_socket(const char* path);
+void* metrics_exporter_thread(void* arg);
+int start_metrics_exporter();
+
+// Log-linear buckets, eight per power of two, of nanoseconds per write.
+// Only filled in when write_latency points at one.
+struct latency_histogram {
+    atomic_ullong counts[LATENCY_BUCKETS];
+};
+
+unsigned latency_bucket(unsigned long long nanoseconds);
+unsigned long long latency_bucket_floor(unsigned bucket);
+void record_write_latency(long long started_ns);
+void record_write_time(long long elapsed_ns, unsigned writes);
+
+// Generic cell rate form of a token bucket: next_ns is when the bucket would
+// be full again, and a caller sleeps while it is more than a burst ahead.
+// Lock-free, and an all-zero bucket is a valid empty one.
+struct token_bucket {
+    atomic_llong next_ns;
+};
+
+struct rate_limits {
+    atomic_ullong global_rate;
+    atomic_ullong device_rate;
+    atomic_llong checked_ns;
+    long long loaded_mtime_ns;
+    long long loaded_size;
+};
+
+int parse_rate(const char* value, unsigned long long* rate);
+void load_rate_limits(int force);
+int rate_limited();
+long long take_tokens(struct token_bucket* bucket, unsigned long long rate, unsigned long long bytes);
+int apply_worker_policy();
+
+enum wipe_event_kind {
+    EVENT_START,
+    EVENT_PHASE,
+    EVENT_ERROR,
+    EVENT_PROGRESS,
+    EVENT_RESULT,
+    EVENT_SKIPPED
+};
+
+// Fixed size, so a wipe thread only ever copies one into a slot that
+// already exists. code is the phase, errno or result depending on kind.
+struct wipe_event {
+    int kind;
+    int code;
+    long long time_ms;
+    long long duration_ms;
+    long long flush_ms;
+    unsigned long long offset;
+    unsigned long long bytes;
+    unsigned long long size;
+    unsigned pass;
+    unsigned bad_extents;
+    unsigned mismatched_extents;
+    unsigned engines;
+    int fast;
+    char device[64];
+    char serial[128];
+    char wwn[64];
+};
+
+struct event_slot {
+    atomic_ullong sequence;
+    struct wipe_event event;
+};
+
+// Bounded multi-producer, single-consumer ring: a producer claims a slot by
+// advancing tail and publishes it through the slot's sequence, and the
+// logger thread takes slots in order from head. A full ring drops the event
+// and counts it rather than ever making a wipe wait. Each journal line folds
+// into chain, which the certificates quote so edits to either show up.
+struct event_ring {
+    struct event_slot slots[EVENT_RING_SIZE];
+    atomic_ullong tail;
+    unsigned long long head;
+    atomic_ullong dropped;
+    atomic_int running;
+    atomic_int stopping;
+    FILE* journal;
+    unsigned long long chain;
+    unsigned long long reported_drops;
+    pthread_t thread;
+};
+#endif
+
+#ifndef _WIN32
+struct extent {
+    off_t start;
+    off_t end;
+};
+
+struct extent_map {
+    struct extent* extents;
+    size_t count;
+    size_t capacity;
+};
+#endif
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+struct bus_group {
+    char bus[PATH_MAX];
+    unsigned active;
+    struct bus_group* next;
+};
+#endif
+
+struct wipe_job {
+    char* device_path;
+    unsigned long long size;
+    int fast;
+    #ifndef _WIN32
+    struct wipe_metrics* metrics;
+    char serial[128];
+    char wwn[64];
+    unsigned pass;
+    size_t io_size;
+    off_t resume_offset;
+    off_t checkpoint_offset;
+    long long checkpoint_started;
+    struct extent_map bad_extents;
+    struct extent_map mismatched_extents;
+    off_t verified_offset;
+    int verify_failed;
+    atomic_int cancelled;
+    struct token_bucket throttle;
+    long long started_ms;
+    atomic_ullong bytes_written;
+    atomic_ullong flush_ns;
+    enum io_engine_kind engine;
+    unsigned engines_used;
+    char device_class[32];
+    #endif
+    #if !defined(_WIN32) && !defined(__APPLE__)
+    char bus[PATH_MAX];
+    struct bus_group* group;
+    struct wipe_job* next;
+    dev_t devnum;
+    int running;
+    struct wipe_job* registry_next;
+    #endif
+};
+
+#ifndef _WIN32
+int wipe_cancelled(struct wipe_job* job);
+void throttle_io(struct wipe_job* job, unsigned long long bytes);
+void log_wipe_event(struct wipe_job* job, enum wipe_event_kind kind, int code, unsigned long long offset);
+int push_wipe_event(const struct wipe_event* event);
+int pop_wipe_event(struct wipe_event* event);
+void write_json_string(FILE* out, const char* text);
+void format_utc_time(long long time_ms, char* text, size_t text_size);
+void write_journal_entry(const struct wipe_event* event);
+int write_wipe_certificate(const struct wipe_event* event);
+void* event_logger_thread(void* arg);
+int start_event_logger();
+void stop_event_logger();
+#endif
+
+void set_wipe_phase(struct wipe_job* job, enum wipe_phase phase);
+void add_bytes_written(struct wipe_job* job, unsigned long long bytes);
+void report_wipe_result(struct wipe_job* job, int result);
+
+int parse_options(int argc, char** argv);
+int parse_passes(const char* spec);
+void print_usage(const char* program);
 
-int wipe_device(const char* device_path);
-int erase_partition_table(const char* device_path);
-int fill_with_zeros(const char* device_path);
+struct wipe_target;
+struct pattern_stream;
+
+int wipe_device(struct wipe_job* job);
+int erase_partition_table(struct wipe_job* job);
+int fill_with_patterns(struct wipe_job* job);
 int check_permissions();
 int device_still_exists(const char* device_path);
 
@@ -50,6 +453,432 @@ int is_system_drive_win(const char* device_path);
 int is_system_drive_mac(const char* device_path);
 #else
 int is_system_drive_linux(const char* device_path);
+
+struct device_set {
+    dev_t* slots;
+    size_t capacity;
+    size_t count;
+};
+
+struct protection_index {
+    pthread_mutex_t lock;
+    struct device_set devices;
+    int stale;
+};
+
+size_t device_slot(dev_t dev, size_t capacity);
+int device_set_add(struct device_set* set, dev_t dev);
+int device_set_contains(const struct device_set* set, dev_t dev);
+void device_set_free(struct device_set* set);
+int read_sysfs_devt(const char* path, dev_t* dev);
+int protect_device_stack(struct device_set* set, dev_t dev);
+int build_protection_index(struct device_set* set);
+void invalidate_protection_index();
+int stack_rests_on_protected(dev_t dev, int depth);
+
+struct uring {
+    int ring_fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+int uring_init(struct uring* ring, unsigned entries);
+void uring_exit(struct uring* ring);
+int uring_register_target(struct uring* ring, int fd, char* buffer, size_t buffer_size);
+int uring_enter(struct uring* ring, unsigned to_submit, unsigned wait_nr);
+int fill_range_uring(struct wipe_target* target, struct pattern_stream* stream, unsigned depth);
+
+enum offload_method {
+    OFFLOAD_ZEROOUT,
+    OFFLOAD_SECDISCARD,
+    OFFLOAD_DISCARD,
+    OFFLOAD_NONE
+};
+
+struct offload_caps {
+    unsigned long long discard_max_bytes;
+    unsigned long long discard_granularity;
+    unsigned long long write_zeroes_max_bytes;
+    unsigned long long discard_zeroes_data;
+};
+
+int read_sysfs_ull(const char* path, unsigned long long* value);
+int read_queue_limit(dev_t devnum, const char* name, unsigned long long* value);
+int probe_offload_caps(const char* device_path, struct offload_caps* caps);
+int offload_supported(const struct offload_caps* caps, enum offload_method method);
+int offload_range(int fd, enum offload_method method, off_t start, off_t end);
+
+// Every queued or running job is also on the registry until its worker
+// frees it, so udev events can find it by device number.
+struct wipe_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct wipe_job* queue;
+    struct bus_group* groups;
+    struct wipe_job* registry;
+};
+
+void get_bus_key(struct udev_device* dev, char* key, size_t key_size);
+void describe_device_class(dev_t devnum, const char* devnode, const char* transport, char* text, size_t text_size);
+struct wipe_job* create_wipe_job(struct udev_device* dev, const char* devnode);
+void free_wipe_job(struct wipe_job* job);
+struct bus_group* find_bus_group(const char* bus);
+int start_wipe_pool(unsigned workers);
+void submit_wipe_job(struct wipe_job* job);
+int compare_job_size(const void* a, const void* b);
+void submit_wipe_jobs(struct wipe_job** jobs, unsigned count);
+struct wipe_job* take_next_job();
+void* wipe_worker_thread(void* arg);
+struct wipe_job* find_registered_job(dev_t devnum);
+void unregister_wipe_job(struct wipe_job* job);
+void cancel_wipe_job(dev_t devnum);
+
+// The udev events of one settle window, one entry per device: whether it
+// went away at some point and, if its last event was an add, that event.
+struct batched_device {
+    dev_t devnum;
+    int removed;
+    struct udev_device* added;
+};
+
+struct device_batch {
+    struct batched_device devices[MAX_EVENT_BATCH];
+    unsigned count;
+    long long deadline_ms;
+};
+
+void batch_device_event(struct device_batch* batch, struct udev_device* dev);
+void flush_device_batch(struct device_batch* batch);
+#endif
+
+#ifndef _WIN32
+// Every call the wipe path makes on a device goes through one of these,
+// looked up by descriptor. block_backend is the real disk; with --simulate,
+// simulated_backend stands regular files in for disks so the scheduler and
+// the whole wipe run unprivileged, with latency, bandwidth, write errors and
+// removal injected as the spec asks.
+struct device_backend {
+    const char* name;
+    int (*open)(const char* path, int flags);
+    int (*close)(int fd);
+    ssize_t (*pwrite)(int fd, const void* buffer, size_t length, off_t offset);
+    ssize_t (*pwritev)(int fd, const struct iovec* iovecs, int count, off_t offset);
+    ssize_t (*pread)(int fd, void* buffer, size_t length, off_t offset);
+    int (*flush)(int fd);
+    int (*geometry)(int fd, off_t* size, unsigned* logical, unsigned* physical);
+    int (*exists)(const char* path);
+};
+
+struct simulation {
+    long long latency_ns;
+    unsigned long long rate;
+    unsigned long long remove_after;
+    unsigned block_size;
+    struct extent failures[MAX_SIMULATED_FAILURES];
+    unsigned failure_count;
+};
+
+// Shared by every descriptor open on the same backing file, so removal and
+// bandwidth apply to the disk rather than to one descriptor.
+struct simulated_device {
+    dev_t dev;
+    ino_t ino;
+    atomic_ullong written;
+    atomic_int removed;
+    struct token_bucket bandwidth;
+};
+
+const struct device_backend* backend_for_path(const char* path);
+const struct device_backend* fd_backend(int fd);
+int device_open(const char* path, int flags);
+int device_close(int fd);
+ssize_t device_pwrite(int fd, const void* buffer, size_t length, off_t offset);
+ssize_t device_pwritev(int fd, const struct iovec* iovecs, int count, off_t offset);
+ssize_t device_pread(int fd, void* buffer, size_t length, off_t offset);
+int device_flush(int fd);
+int block_open(const char* path, int flags);
+int block_flush(int fd);
+int block_geometry(int fd, off_t* size, unsigned* logical, unsigned* physical);
+int block_exists(const char* path);
+int parse_simulation(const char* spec);
+struct simulated_device* find_simulated_device(const struct stat* st, int create);
+int simulate_io(int fd, off_t offset, size_t length, int write);
+int simulated_open(const char* path, int flags);
+int simulated_close(int fd);
+ssize_t simulated_pwrite(int fd, const void* buffer, size_t length, off_t offset);
+ssize_t simulated_pwritev(int fd, const struct iovec* iovecs, int count, off_t offset);
+ssize_t simulated_pread(int fd, void* buffer, size_t length, off_t offset);
+int simulated_geometry(int fd, off_t* size, unsigned* logical, unsigned* physical);
+int simulated_exists(const char* path);
+
+struct wipe_target {
+    struct wipe_job* job;
+    int fd;
+    off_t size;
+    unsigned logical_block_size;
+    unsigned physical_block_size;
+    size_t alignment;
+    int direct;
+    int mappable;
+    int regular_file;
+    int track_progress;
+    const struct wipe_pass* pass;
+    unsigned long long seed;
+    struct verifier* verifier;
+    atomic_llong* range_written;
+    struct extent_map* bad_extents;
+    off_t dirty_start;
+    off_t writeback_start;
+};
+
+// One slice of a device written by its own thread. target is a copy of the
+// device's with a descriptor of its own, reporting progress into written and
+// failed blocks into bad_extents; the wipe thread folds both back in.
+struct fill_range {
+    struct wipe_target target;
+    char* buffer;
+    size_t buffer_size;
+    off_t end;
+    atomic_llong written;
+    atomic_int done;
+    struct extent_map bad_extents;
+    int result;
+    pthread_t thread;
+};
+
+// Hands the writer the pattern for [start, end) in chunk_size pieces. A
+// zero or fixed-byte pass is one constant buffer; a random pass is a ring
+// of slot_count chunks that producer threads generate ahead of the writer.
+struct pattern_stream {
+    const struct wipe_pass* pass;
+    unsigned long long seed;
+    off_t start;
+    off_t end;
+    size_t chunk_size;
+    char* buffer;
+    size_t buffer_size;
+    unsigned slot_count;
+    long long* slot_sequence;
+    int* slot_ready;
+    long long next_sequence;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t producers[PATTERN_PRODUCERS];
+    unsigned producer_count;
+};
+
+// Reads back what the writer has finished, trailing it by
+// options.verify_window bytes. The writer publishes its position through
+// written; mismatches is only touched by the verify thread until it is joined.
+struct verifier {
+    struct wipe_job* job;
+    const struct wipe_pass* pass;
+    unsigned long long seed;
+    int fd;
+    unsigned block_size;
+    size_t alignment;
+    off_t start;
+    off_t end;
+    off_t verified;
+    atomic_llong written;
+    atomic_int writer_done;
+    int failed;
+    int sparse;
+    pthread_t thread;
+};
+
+// One way of moving a pattern stream onto a target. usable says whether it
+// can write this target and pass at all; fill may still return
+// ENGINE_UNAVAILABLE before writing anything, and the write engine takes over.
+struct io_engine {
+    const char* name;
+    int (*usable)(struct wipe_target* target);
+    int (*fill)(struct wipe_target* target, struct pattern_stream* stream);
+};
+
+int open_wipe_target(struct wipe_job* job, struct wipe_target* target);
+void close_wipe_target(struct wipe_target* target);
+char* alloc_io_buffer(size_t size, size_t alignment);
+void map_zero_region();
+char* shared_zero_region();
+int fill_target_range(struct wipe_target* target, char* buffer, size_t buffer_size,
+                      off_t start, off_t end, enum io_engine_kind engine);
+const char* engine_name(enum io_engine_kind kind);
+int engine_usable(enum io_engine_kind kind, struct wipe_target* target);
+int uring_engine_usable(struct wipe_target* target);
+int write_engine_usable(struct wipe_target* target);
+int mmap_engine_usable(struct wipe_target* target);
+int splice_engine_usable(struct wipe_target* target);
+int uring_engine_fill(struct wipe_target* target, struct pattern_stream* stream);
+int write_engine_fill(struct wipe_target* target, struct pattern_stream* stream);
+int write_unaligned_range(struct wipe_target* target, const char* buffer, size_t buffer_size,
+                          off_t start, off_t end);
+unsigned claim_range_workers(unsigned wanted);
+int fill_partitioned_range(struct wipe_target* target, char* buffer, size_t buffer_size, off_t start, off_t end);
+void* fill_range_thread(void* arg);
+int fill_range_write(struct wipe_target* target, struct pattern_stream* stream);
+int fill_range_writev(struct wipe_target* target, struct pattern_stream* stream);
+int fill_range_mmap(struct wipe_target* target, struct pattern_stream* stream);
+#ifndef __APPLE__
+int fill_range_splice(struct wipe_target* target, struct pattern_stream* stream);
+size_t open_splice_pipe(int fds[2]);
+void probe_splice_support();
+#endif
+void mmap_fault_handler(int signal_number);
+void install_mmap_fault_handler();
+int store_mapped_chunk(char* map, const char* data, size_t length);
+void release_mmap_window(char* map, size_t length);
+int is_media_error(int error);
+int pwrite_all(int fd, const char* buffer, size_t length, off_t offset);
+int add_extent(struct extent_map* map, off_t start, off_t end);
+int recover_failed_range(struct wipe_target* target, const char* buffer, off_t start, off_t end);
+
+// A line of <state_dir>/wiped.index: a completed wipe and the fingerprint
+// the disk had right after it.
+struct wiped_entry {
+    long long wiped_at;
+    unsigned long long fingerprint;
+    char plan[128];
+    char key[512];
+};
+
+unsigned long long hash_bytes(const void* data, size_t length, unsigned long long hash);
+
+// FIPS 180-4 SHA-256, used only to sign certificates.
+struct sha256 {
+    uint32_t state[8];
+    unsigned long long length;
+    unsigned char block[64];
+    size_t used;
+};
+
+// The --certificate-key secret, already padded or hashed to one block.
+struct certificate_key {
+    unsigned char bytes[64];
+    int loaded;
+};
+
+uint32_t rotate_right(uint32_t value, unsigned count);
+void sha256_init(struct sha256* sha);
+void sha256_block(struct sha256* sha, const unsigned char* block);
+void sha256_update(struct sha256* sha, const void* data, size_t length);
+void sha256_final(struct sha256* sha, unsigned char digest[32]);
+void hmac_sha256(const unsigned char key[64], const void* data, size_t length, unsigned char mac[32]);
+int load_certificate_key();
+int wipe_identity(struct wipe_job* job, char* key, size_t key_size);
+int checkpoint_path(struct wipe_job* job, char* path, size_t path_size, char* key, size_t key_size);
+int load_checkpoint(struct wipe_job* job, unsigned* pass, off_t* offset);
+int save_checkpoint(struct wipe_job* job, off_t offset);
+void clear_checkpoint(struct wipe_job* job);
+void wipe_plan(char* text, size_t text_size);
+int fingerprint_device(struct wipe_job* job, unsigned long long seed, unsigned long long* fingerprint);
+int fingerprint_prefix(struct wipe_job* job, unsigned long long seed, off_t end, unsigned long long* fingerprint);
+unsigned long long checkpoint_seed(const char* key, long long started_at);
+int read_wiped_index(struct wiped_entry* entries, int max_count);
+int recently_wiped(struct wipe_job* job, long long* wiped_at);
+void record_wiped_device(struct wipe_job* job);
+void record_fill_progress(struct wipe_target* target, off_t offset);
+int flush_target(struct wipe_target* target);
+void add_flush_time(struct wipe_job* job, long long started_ns);
+void bound_dirty_pages(struct wipe_target* target, off_t offset);
+
+int io_size_candidates(struct wipe_target* target, size_t* sizes, int max_count);
+int offload_expected(struct wipe_target* target, const struct wipe_pass* pass);
+int calibrate_io_size(struct wipe_target* target, char* buffer, const size_t* sizes, int count, off_t* start);
+void engine_class(struct wipe_target* target, char* text, size_t text_size);
+int find_engine_choice(const char* device_class, enum io_engine_kind* kind);
+void remember_engine_choice(const char* device_class, enum io_engine_kind kind);
+int probe_io_engines(struct wipe_target* target, char* buffer, size_t buffer_size, off_t* start,
+                     enum io_engine_kind* chosen);
+int select_io_engine(struct wipe_target* target, char* buffer, size_t buffer_size, off_t* start);
+void format_engines(unsigned engines, char* text, size_t text_size);
+
+int buffer_is_zero(const char* data, size_t length);
+int buffer_is_zero_scalar(const char* data, size_t length);
+#if defined(__x86_64__) || defined(__i386__)
+int buffer_is_zero_sse2(const char* data, size_t length);
+int buffer_is_zero_avx2(const char* data, size_t length);
+#elif defined(__aarch64__)
+int buffer_is_zero_neon(const char* data, size_t length);
+#endif
+void stream_store_scalar(char* dst, const char* src, size_t length);
+#if defined(__x86_64__) || defined(__i386__)
+void stream_store_sse2(char* dst, const char* src, size_t length);
+void stream_store_avx2(char* dst, const char* src, size_t length);
+#endif
+void select_simd_kernels();
+void store_nontemporal(char* dst, const char* src, size_t length);
+
+unsigned long long splitmix64(unsigned long long* state);
+unsigned long long pattern_seed(struct wipe_job* job, unsigned pass);
+void seed_pattern_block(unsigned long long seed, unsigned long long block, uint64_t state[4][PATTERN_LANES]);
+void xoshiro_fill_scalar(uint64_t state[4][PATTERN_LANES], char* out, size_t length);
+#if defined(__x86_64__) || defined(__i386__)
+void xoshiro_fill_avx2(uint64_t state[4][PATTERN_LANES], char* out, size_t length);
+#endif
+void fill_pattern(const struct wipe_pass* pass, unsigned long long seed, off_t offset, char* buffer, size_t length);
+int pattern_matches(const struct wipe_pass* pass, const char* data, const char* expected, size_t length);
+void constant_pattern_stream(struct pattern_stream* stream, const char* buffer, size_t buffer_size,
+                             off_t start, off_t end);
+int open_pattern_stream(struct pattern_stream* stream, struct wipe_target* target, char* buffer,
+                        size_t buffer_size, off_t start, off_t end);
+void close_pattern_stream(struct pattern_stream* stream);
+void* pattern_producer_thread(void* arg);
+char* acquire_pattern_chunk(struct pattern_stream* stream, long long sequence);
+void release_pattern_chunk(struct pattern_stream* stream, long long sequence);
+int extent_overlaps(const struct extent_map* map, off_t start, off_t end);
+int open_verify_fd(const char* device_path);
+int verify_range(struct verifier* verifier, char* buffer, char* expected, off_t start, off_t end);
+void* verify_thread(void* arg);
+int start_verifier(struct wipe_target* target, struct verifier* verifier, off_t start);
+int finish_verifier(struct wipe_target* target, struct verifier* verifier, int fill_result);
+int recheck_block(struct wipe_target* target, int fd, char* expected, char* read_buffer, off_t start, off_t end);
+
+struct signature_scan {
+    struct wipe_job* job;
+    int fd;
+    off_t size;
+    char* buffer;
+    struct extent_map erase;
+    int failed;
+};
+
+unsigned long long read_le(const unsigned char* bytes, int count);
+unsigned long long read_be(const unsigned char* bytes, int count);
+const unsigned char* read_probe(struct signature_scan* scan, off_t offset, size_t length);
+void mark_signature(struct signature_scan* scan, const char* name, off_t start, off_t length);
+int collect_partitions(struct signature_scan* scan, off_t* starts, off_t* lengths, int max_count);
+void probe_ext(struct signature_scan* scan, off_t base, off_t length);
+void probe_xfs(struct signature_scan* scan, off_t base, off_t length);
+void probe_btrfs(struct signature_scan* scan, off_t base, off_t length);
+void probe_ntfs(struct signature_scan* scan, off_t base, off_t length);
+void probe_luks(struct signature_scan* scan, off_t base, off_t length);
+void probe_lvm(struct signature_scan* scan, off_t base, off_t length);
+void probe_md(struct signature_scan* scan, off_t base, off_t length);
+void scan_region(struct signature_scan* scan, off_t base, off_t length);
+int destroy_signatures(struct wipe_job* job);
+
+int fill_file_extents(struct wipe_target* target, char* buffer, size_t buffer_size, off_t start);
+struct wipe_job* create_file_job(const char* path, const struct stat* st);
+int collect_file_targets(const char* path, struct wipe_job*** jobs, size_t* count, size_t* capacity);
+int wipe_listed_targets();
+#endif
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+int fill_with_offload(struct wipe_target* target, char* buffer, size_t buffer_size, off_t start);
 #endif
 
 #ifdef _WIN32
@@ -63,7 +892,7 @@ void enumerate_existing_devices_win();
 #elif __APPLE__
 void enumerate_existing_devices_mac();
 #else
-void enumerate_existing_devices_linux();
+void enumerate_existing_devices_linux(struct udev* udev, struct device_batch* batch);
 #endif
 
 #ifdef _WIN32
@@ -77,21 +906,63 @@ void monitor_devices_mac();
 void monitor_devices_linux();
 #endif
 
-int main() {
+#ifndef STORAGE_CLEANER_NO_MAIN
+int main(int argc, char** argv) {
     #ifndef _WIN32
     signal(SIGPIPE, SIG_IGN);
     #endif
 
-    if (!check_permissions()) {
+    if (parse_options(argc, argv) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Simulated disks are ordinary files the caller can already write.
+    if (!(options.simulate && options.target_count > 0) && !check_permissions()) {
+        return 1;
+    }
+
+    #ifndef _WIN32
+    if (mkdir(options.state_dir, 0700) != 0 && errno != EEXIST) {
+        options.state_dir = NULL;
+    }
+
+    if (start_metrics_exporter() != 0) {
+        return 1;
+    }
+    if (load_certificate_key() != 0) {
+        fprintf(stderr, "%s: cannot read the certificate key: %s\n", options.certificate_key, strerror(errno));
+        return 1;
+    }
+    if (start_event_logger() != 0) {
+        fprintf(stderr, "%s: cannot open the event journal: %s\n", options.state_dir, strerror(errno));
+        return 1;
+    }
+    load_rate_limits(1);
+    if (apply_worker_policy() != 0) {
+        fprintf(stderr, "cannot apply --io-class or --cpus\n");
+        return 1;
+    }
+    #endif
+
+    #if !defined(_WIN32) && !defined(__APPLE__)
+    if (start_wipe_pool(options.workers) != 0) {
         return 1;
     }
+    #endif
+
+    #ifndef _WIN32
+    if (options.target_count > 0) {
+        int result = wipe_listed_targets();
+        stop_event_logger();
+        return result == 0 ? 0 : 1;
+    }
+    #endif
 
     #ifdef _WIN32
     enumerate_existing_devices_win();
     #elif __APPLE__
     enumerate_existing_devices_mac();
-    #else
-    enumerate_existing_devices_linux();
     #endif
 
     #ifdef _WIN32
@@ -103,362 +974,5771 @@ int main() {
     #endif
     return 0;
 }
+#endif
 
-int check_permissions() {
-    #ifdef _WIN32
-    HANDLE hToken = NULL;
-    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken)) {
-        return 0;
+void print_usage(const char* program) {
+    fprintf(stderr,
+            #ifdef _WIN32
+            "Usage: %s [options]\n"
+            "Wipes every non-system disk present or plugged in.\n"
+            #else
+            "Usage: %s [options] [file or directory...]\n"
+            "Without targets, wipes every non-system disk present or plugged in. With targets,\n"
+            "wipes the listed files, the regular files under the listed directories and the\n"
+            "listed block devices, then exits.\n"
+            #endif
+            "  --engine auto|uring|write|mmap|splice\n"
+            "                         I/O engine for the fill; auto measures the usable ones on the\n"
+            "                         first device of each class and keeps the fastest (default: auto).\n"
+            "                         mmap needs a buffered target, splice a zero pass on Linux\n"
+            "  --queue-depth N        writes in flight per device with io_uring (default: %d)\n"
+            "  --io-size KB|auto      write size, a multiple of 4, or auto to pick one per device from\n"
+            "                         its queue limits and a short calibration (default: auto)\n"
+            "  --buffered             write block devices through the page cache instead of O_DIRECT\n"
+            "  --dirty-window MB      page cache each buffered writer may fill before it waits for\n"
+            "                         writeback, 0 to leave it to the kernel (default: %d)\n"
+            "  --no-offload           never use BLKZEROOUT/BLKDISCARD/BLKSECDISCARD or hole punching,\n"
+            "                         always write zeros\n"
+            "  --workers N            devices wiped at the same time (default: %d)\n"
+            "  --per-bus N            devices wiped at the same time behind one USB root hub or\n"
+            "                         storage controller (default: %d)\n"
+            "  --settle-ms N          collect udev events for N ms after the first of a burst and\n"
+            "                         queue the devices together, 0 to queue each at once (default: %d)\n"
+            "  --ranges N             split each device into up to N slices of at least %lld GiB written\n"
+            "                         in parallel, using threads left over from --workers (default: 1)\n"
+            "  --metrics-file PATH    write per-device progress as Prometheus text to PATH\n"
+            "  --metrics-socket PATH  serve per-device progress as Prometheus text on a Unix socket\n"
+            "  --metrics-interval N   seconds between metric updates (default: %d)\n"
+            "  --state-dir PATH       directory for wipe checkpoints, the event journal, the index of\n"
+            "                         recent wipes and a certificate per finished wipe (default: %s)\n"
+            "  --certificate-key PATH sign each certificate with HMAC-SHA256 under the key held in PATH;\n"
+            "                         without one, certificates only carry checksums that anyone who\n"
+            "                         edits them can recompute\n"
+            "  --rewipe-after HOURS   skip a re-plugged disk wiped less than HOURS ago whose sampled\n"
+            "                         blocks still read as the wipe left them, 0 to always wipe;\n"
+            "                         an interrupted wipe older than this starts over (default: %d)\n"
+            "  --verify               read every block of the last pass back during the fill and fail\n"
+            "                         drives that do not hold the pattern\n"
+            "  --verify-window MB     how far the read-back trails the writer (default: %d)\n"
+            "  --pattern LIST         comma-separated overwrite passes, each zero, random or a byte\n"
+            "                         such as 0xff, up to %d passes (default: zero)\n"
+            "  --fast                 only zero partition tables and the filesystem, RAID, LVM and\n"
+            "                         LUKS metadata found on the disk instead of overwriting it\n"
+            "  --max-mbps N           cap the combined write and verify rate of all wipes\n"
+            "  --device-mbps N        cap the rate of each wipe\n"
+            "  --limits-file PATH     file of max-mbps=N and device-mbps=N lines, re-read when it\n"
+            "                         changes, to adjust the caps while running\n"
+            "  --io-class CLASS       I/O priority of the wipe threads: idle, or best-effort with an\n"
+            "                         optional level such as best-effort:7 (Linux)\n"
+            "  --cpus LIST            pin the wipe threads to CPUs such as 0-3,6 (Linux)\n"
+            "  --simulate SPEC        wipe the listed regular files as simulated disks, without root;\n"
+            "                         SPEC is a comma-separated list of latency-us=N, mbps=N, block=N,\n"
+            "                         remove-after-mb=N and fail=OFFSET+LENGTH, or none\n",
+            program, DEFAULT_QUEUE_DEPTH, DEFAULT_DIRTY_WINDOW_MB, DEFAULT_WORKERS, DEFAULT_JOBS_PER_BUS,
+            DEFAULT_SETTLE_MS, MIN_RANGE_SIZE >> 30,
+            DEFAULT_METRICS_INTERVAL,
+            DEFAULT_STATE_DIR, DEFAULT_REWIPE_HOURS, DEFAULT_VERIFY_WINDOW_MB, MAX_PASSES);
+}
+
+int parse_options(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "--engine") == 0 && value) {
+            if (strcmp(value, "uring") == 0) {
+                options.engine = IO_ENGINE_URING;
+            } else if (strcmp(value, "write") == 0) {
+                options.engine = IO_ENGINE_WRITE;
+            } else if (strcmp(value, "mmap") == 0) {
+                options.engine = IO_ENGINE_MMAP;
+            } else if (strcmp(value, "splice") == 0) {
+                options.engine = IO_ENGINE_SPLICE;
+            } else if (strcmp(value, "auto") == 0) {
+                options.engine = IO_ENGINE_AUTO;
+            } else {
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && value) {
+            int depth = atoi(value);
+            if (depth < 1 || depth > MAX_QUEUE_DEPTH) {
+                return -1;
+            }
+            options.queue_depth = (unsigned)depth;
+            i++;
+        } else if (strcmp(argv[i], "--io-size") == 0 && value && strcmp(value, "auto") == 0) {
+            options.io_size = 0;
+            i++;
+        } else if (strcmp(argv[i], "--io-size") == 0 && value) {
+            int kilobytes = atoi(value);
+            if (kilobytes < 4 || kilobytes % 4 != 0 || kilobytes > MAX_IO_SIZE / 1024) {
+                return -1;
+            }
+            options.io_size = (size_t)kilobytes * 1024;
+            i++;
+        } else if (strcmp(argv[i], "--buffered") == 0) {
+            options.direct = 0;
+        } else if (strcmp(argv[i], "--no-offload") == 0) {
+            options.offload = 0;
+        } else if (strcmp(argv[i], "--workers") == 0 && value) {
+            int workers = atoi(value);
+            if (workers < 1) {
+                return -1;
+            }
+            options.workers = (unsigned)workers;
+            i++;
+        } else if (strcmp(argv[i], "--ranges") == 0 && value) {
+            int ranges = atoi(value);
+            if (ranges < 1 || ranges > MAX_RANGES) {
+                return -1;
+            }
+            options.ranges = (unsigned)ranges;
+            i++;
+        } else if (strcmp(argv[i], "--per-bus") == 0 && value) {
+            int per_bus = atoi(value);
+            if (per_bus < 1) {
+                return -1;
+            }
+            options.jobs_per_bus = (unsigned)per_bus;
+            i++;
+        } else if (strcmp(argv[i], "--settle-ms") == 0 && value) {
+            int settle = atoi(value);
+            if (settle < 0) {
+                return -1;
+            }
+            options.settle_ms = (unsigned)settle;
+            i++;
+        } else if (strcmp(argv[i], "--metrics-file") == 0 && value) {
+            options.metrics_file = value;
+            i++;
+        } else if (strcmp(argv[i], "--metrics-socket") == 0 && value) {
+            options.metrics_socket = value;
+            i++;
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && value) {
+            int interval = atoi(value);
+            if (interval < 1) {
+                return -1;
+            }
+            options.metrics_interval = (unsigned)interval;
+            i++;
+        } else if (strcmp(argv[i], "--state-dir") == 0 && value) {
+            options.state_dir = value;
+            i++;
+        #ifndef _WIN32
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            options.verify = 1;
+        } else if (strcmp(argv[i], "--verify-window") == 0 && value) {
+            int window = atoi(value);
+            if (window < 0) {
+                return -1;
+            }
+            options.verify_window = (unsigned long long)window * 1024 * 1024;
+            i++;
+        #endif
+        } else if (strcmp(argv[i], "--dirty-window") == 0 && value) {
+            int window = atoi(value);
+            if (window < 0) {
+                return -1;
+            }
+            options.dirty_window = (unsigned long long)window * 1024 * 1024;
+            i++;
+        } else if (strcmp(argv[i], "--certificate-key") == 0 && value) {
+            options.certificate_key = value;
+            i++;
+        } else if (strcmp(argv[i], "--rewipe-after") == 0 && value) {
+            int hours = atoi(value);
+            if (hours < 0) {
+                return -1;
+            }
+            options.rewipe_after = (unsigned)hours;
+            i++;
+        #ifndef _WIN32
+        } else if (strcmp(argv[i], "--fast") == 0) {
+            options.fast = 1;
+        } else if (strcmp(argv[i], "--max-mbps") == 0 && value) {
+            if (parse_rate(value, &options.max_rate) != 0) {
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--device-mbps") == 0 && value) {
+            if (parse_rate(value, &options.device_rate) != 0) {
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--limits-file") == 0 && value) {
+            options.limits_file = value;
+            i++;
+        } else if (strcmp(argv[i], "--io-class") == 0 && value) {
+            if (strcmp(value, "idle") == 0) {
+                options.io_class = 3;
+            #ifndef __APPLE__
+            } else if (strncmp(value, "best-effort", 11) == 0 && (value[11] == '\0' || value[11] == ':')) {
+                options.io_class = 2;
+                options.io_level = value[11] == ':' ? atoi(value + 12) : 4;
+                if (options.io_level < 0 || options.io_level > 7) {
+                    return -1;
+                }
+            #endif
+            } else {
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--cpus") == 0 && value) {
+            options.cpu_list = value;
+            i++;
+        #endif
+        } else if (strcmp(argv[i], "--pattern") == 0 && value) {
+            if (parse_passes(value) != 0) {
+                return -1;
+            }
+            #ifdef _WIN32
+            // The Windows fill only knows a single zero pass.
+            if (options.pass_count != 1 || options.passes[0].kind != PATTERN_ZERO) {
+                return -1;
+            }
+            #endif
+            i++;
+        #ifndef _WIN32
+        } else if (strcmp(argv[i], "--simulate") == 0 && value) {
+            if (parse_simulation(value) != 0) {
+                return -1;
+            }
+            options.simulate = value;
+            i++;
+        } else if (argv[i][0] != '-' && options.target_count < MAX_TARGETS) {
+            options.targets[options.target_count++] = argv[i];
+        #endif
+        } else {
+            return -1;
+        }
     }
+    return 0;
+}
 
-    TOKEN_ELEVATION elevation;
-    DWORD dwSize = sizeof(TOKEN_ELEVATION);
-    if (!GetTokenInformation(hToken, TokenElevation, &elevation, sizeof(elevation), &dwSize)) {
-        CloseHandle(hToken);
-        return 0;
+int parse_passes(const char* spec) {
+    struct wipe_pass passes[MAX_PASSES];
+    unsigned count = 0;
+    const char* token = spec;
+
+    while (1) {
+        size_t length = strcspn(token, ",");
+        if (length == 0 || count == MAX_PASSES) {
+            return -1;
+        }
+
+        if (length == 4 && strncmp(token, "zero", 4) == 0) {
+            passes[count].kind = PATTERN_ZERO;
+            passes[count].byte = 0;
+        } else if (length == 6 && strncmp(token, "random", 6) == 0) {
+            passes[count].kind = PATTERN_RANDOM;
+            passes[count].byte = 0;
+        } else {
+            char* parsed_end = NULL;
+            unsigned long byte = strtoul(token, &parsed_end, 0);
+            if (parsed_end != token + length || byte > 0xff) {
+                return -1;
+            }
+            passes[count].kind = byte == 0 ? PATTERN_ZERO : PATTERN_BYTE;
+            passes[count].byte = (unsigned char)byte;
+        }
+        count++;
+
+        if (token[length] == '\0') {
+            break;
+        }
+        token += length + 1;
     }
 
-    CloseHandle(hToken);
-    return elevation.TokenIsElevated;
+    memcpy(options.passes, passes, sizeof(passes[0]) * count);
+    options.pass_count = count;
+    options.pattern_spec = spec;
+    return 0;
+}
+
+#ifndef _WIN32
+struct wipe_metrics metrics_table[MAX_TRACKED_DEVICES];
+
+const char* wipe_phase_names[] = { "queued", "partition_erase", "fill", "verify", "done", "failed", "cancelled" };
+
+long long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+struct latency_histogram* write_latency = NULL;
+
+unsigned latency_bucket(unsigned long long nanoseconds) {
+    if (nanoseconds < 8) {
+        return (unsigned)nanoseconds;
+    }
+    unsigned exponent = 63 - (unsigned)__builtin_clzll(nanoseconds);
+    return (exponent - 2) * 8 + (unsigned)((nanoseconds >> (exponent - 3)) & 7);
+}
+
+unsigned long long latency_bucket_floor(unsigned bucket) {
+    if (bucket < 8) {
+        return bucket;
+    }
+    return (8ULL + bucket % 8) << (bucket / 8 - 1);
+}
+
+void record_write_latency(long long started_ns) {
+    if (write_latency && started_ns > 0) {
+        record_write_time(monotonic_ns() - started_ns, 1);
+    }
+}
+
+// Spreads the time one call took over the chunk-sized writes it stood for,
+// so engines that batch count writes the same way as those that do not.
+void record_write_time(long long elapsed_ns, unsigned writes) {
+    if (write_latency && writes > 0) {
+        unsigned long long each = elapsed_ns > 0 ? (unsigned long long)elapsed_ns / writes : 0;
+        atomic_fetch_add_explicit(&write_latency->counts[latency_bucket(each)], writes, memory_order_relaxed);
+    }
+}
+
+struct rate_limits rate_limits;
+
+// Threads writing to a device right now. A wipe only splits its device into
+// ranges with threads that leave this within options.workers.
+atomic_uint active_writers;
+
+int parse_rate(const char* value, unsigned long long* rate) {
+    char* end;
+    unsigned long long megabytes = strtoull(value, &end, 10);
+    if (end == value || *end != '\0') {
+        return -1;
+    }
+    *rate = megabytes * 1000 * 1000;
+    return 0;
+}
+
+// Takes the command-line caps, then overrides them from --limits-file
+// whenever its size or mtime changes. Every reload starts again from the
+// command-line caps, so deleting a line lifts what it set. Writers call
+// this at most once a second.
+void load_rate_limits(int force) {
+    if (force) {
+        atomic_store(&rate_limits.global_rate, options.max_rate);
+        atomic_store(&rate_limits.device_rate, options.device_rate);
+    }
+    if (!options.limits_file) {
+        return;
+    }
+
+    long long now = monotonic_ns();
+    long long checked = atomic_load(&rate_limits.checked_ns);
+    if (!force && (now - checked < LIMITS_RELOAD_NS ||
+                   !atomic_compare_exchange_strong(&rate_limits.checked_ns, &checked, now))) {
+        return;
+    }
+
+    struct stat st;
+    if (stat(options.limits_file, &st) != 0) {
+        return;
+    }
+    #ifdef __APPLE__
+    long long mtime_ns = (long long)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
     #else
-    return geteuid() == 0;
+    long long mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
     #endif
+    if (!force && mtime_ns == rate_limits.loaded_mtime_ns && (long long)st.st_size == rate_limits.loaded_size) {
+        return;
+    }
+    FILE* file = fopen(options.limits_file, "r");
+    if (!file) {
+        return;
+    }
+    rate_limits.loaded_mtime_ns = mtime_ns;
+    rate_limits.loaded_size = (long long)st.st_size;
+
+    unsigned long long global_rate = options.max_rate;
+    unsigned long long device_rate = options.device_rate;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        unsigned long long rate;
+        if (strncmp(line, "max-mbps=", 9) == 0 && parse_rate(line + 9, &rate) == 0) {
+            global_rate = rate;
+        } else if (strncmp(line, "device-mbps=", 12) == 0 && parse_rate(line + 12, &rate) == 0) {
+            device_rate = rate;
+        }
+    }
+    fclose(file);
+    atomic_store(&rate_limits.global_rate, global_rate);
+    atomic_store(&rate_limits.device_rate, device_rate);
 }
 
-int device_still_exists(const char* device_path) {
-    #ifdef _WIN32
-    HANDLE hDevice = CreateFileA(device_path, GENERIC_READ,
-                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
-                                 NULL, OPEN_EXISTING, 0, NULL);
-    if (hDevice == INVALID_HANDLE_VALUE) {
+int rate_limited() {
+    return atomic_load_explicit(&rate_limits.global_rate, memory_order_relaxed) != 0 ||
+           atomic_load_explicit(&rate_limits.device_rate, memory_order_relaxed) != 0;
+}
+
+// Charges bytes against the bucket and returns how long the caller must
+// wait, in nanoseconds, to stay within rate plus one burst.
+long long take_tokens(struct token_bucket* bucket, unsigned long long rate, unsigned long long bytes) {
+    if (rate == 0) {
         return 0;
     }
-    CloseHandle(hDevice);
-    return 1;
-    #else
-    int fd = open(device_path, O_RDONLY);
-    if (fd == -1) {
-        return 0;
+    long long cost = (long long)((double)bytes * 1e9 / (double)rate);
+    long long now = monotonic_ns();
+    long long next = atomic_load(&bucket->next_ns);
+    long long updated;
+    do {
+        updated = (next > now ? next : now) + cost;
+    } while (!atomic_compare_exchange_weak(&bucket->next_ns, &next, updated));
+    return updated - now - THROTTLE_BURST_NS;
+}
+
+void throttle_io(struct wipe_job* job, unsigned long long bytes) {
+    load_rate_limits(0);
+    if (!rate_limited()) {
+        return;
+    }
+
+    static struct token_bucket global_bucket;
+    long long wait = take_tokens(&global_bucket, atomic_load(&rate_limits.global_rate), bytes);
+    long long device_wait = take_tokens(&job->throttle, atomic_load(&rate_limits.device_rate), bytes);
+    if (device_wait > wait) {
+        wait = device_wait;
+    }
+
+    // Sleep in short steps so a removed device is not waited on.
+    while (wait > 0 && !wipe_cancelled(job)) {
+        long long step = wait < THROTTLE_BURST_NS ? wait : THROTTLE_BURST_NS;
+        struct timespec delay = { (time_t)(step / 1000000000), (long)(step % 1000000000) };
+        nanosleep(&delay, NULL);
+        wait -= step;
     }
-    close(fd);
-    return 1;
-    #endif
 }
 
-int wipe_device(const char* device_path) {
-    for (int attempt = 1; attempt <= MAX_RETRIES; attempt++) {
-        if (!device_still_exists(device_path)) {
+// Threads inherit both settings from their creator, so applying them to the
+// main thread before any worker starts covers the whole pool, including
+// pattern producers and verifiers.
+int apply_worker_policy() {
+    #ifdef __APPLE__
+    if (options.io_class == 3 && setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE) != 0) {
+        return -1;
+    }
+    #else
+    if (options.io_class != 0 &&
+        syscall(SYS_ioprio_set, 1, 0, (options.io_class << 13) | options.io_level) != 0) {
+        return -1;
+    }
+
+    if (options.cpu_list) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        const char* token = options.cpu_list;
+        while (*token) {
+            char* end;
+            long first = strtol(token, &end, 10);
+            long last = first;
+            if (end == token) {
+                return -1;
+            }
+            if (*end == '-') {
+                token = end + 1;
+                last = strtol(token, &end, 10);
+                if (end == token) {
+                    return -1;
+                }
+            }
+            if (first < 0 || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+            for (long cpu = first; cpu <= last; cpu++) {
+                CPU_SET((int)cpu, &cpus);
+            }
+            if (*end != ',' && *end != '\0') {
+                return -1;
+            }
+            token = *end == ',' ? end + 1 : end;
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
             return -1;
         }
+    }
+    #endif
+    return 0;
+}
 
-        if (erase_partition_table(device_path) == 0) {
-            if (fill_with_zeros(device_path) == 0) {
-                return 0;
-            }
+int try_claim_metrics(struct wipe_metrics* slot, int expected_state) {
+    int expected = expected_state;
+    return atomic_compare_exchange_strong(&slot->state, &expected, METRICS_SLOT_ACTIVE);
+}
+
+// Slots of finished wipes stay visible until the space is needed. A device
+// that comes back takes over its own old slot so its series is never
+// exported twice.
+struct wipe_metrics* claim_metrics(const char* device_path, const char* bus, unsigned long long total_bytes) {
+    struct wipe_metrics* claimed = NULL;
+
+    for (int i = 0; i < MAX_TRACKED_DEVICES && !claimed; i++) {
+        struct wipe_metrics* slot = &metrics_table[i];
+        if (atomic_load(&slot->state) == METRICS_SLOT_RETIRED &&
+            strcmp(slot->device, device_path) == 0 && try_claim_metrics(slot, METRICS_SLOT_RETIRED)) {
+            claimed = slot;
+        }
+    }
+    for (int i = 0; i < MAX_TRACKED_DEVICES && !claimed; i++) {
+        if (try_claim_metrics(&metrics_table[i], METRICS_SLOT_FREE)) {
+            claimed = &metrics_table[i];
         }
+    }
+    for (int i = 0; i < MAX_TRACKED_DEVICES && !claimed; i++) {
+        if (try_claim_metrics(&metrics_table[i], METRICS_SLOT_RETIRED)) {
+            claimed = &metrics_table[i];
+        }
+    }
+    if (!claimed) {
+        return NULL;
+    }
 
-        if (attempt < MAX_RETRIES) {
-            #ifdef _WIN32
-            Sleep(2000);
-            #else
-            sleep(2);
-            #endif
+    atomic_fetch_add(&claimed->sequence, 1);
+    snprintf(claimed->device, sizeof(claimed->device), "%s", device_path);
+    snprintf(claimed->bus, sizeof(claimed->bus), "%s", bus ? bus : "");
+    atomic_store(&claimed->bytes_written, 0);
+    atomic_store(&claimed->fill_start_bytes, 0);
+    atomic_store(&claimed->total_bytes, total_bytes);
+    atomic_store(&claimed->bytes_verified, 0);
+    atomic_store(&claimed->retries, 0);
+    atomic_store(&claimed->pass, 0);
+    atomic_store(&claimed->io_size, 0);
+    atomic_store(&claimed->flush_ns, 0);
+    atomic_store(&claimed->engine, -1);
+    atomic_store(&claimed->phase, PHASE_QUEUED);
+    atomic_store(&claimed->phase_started_ms, monotonic_ms());
+    atomic_fetch_add(&claimed->sequence, 1);
+    return claimed;
+}
+
+void release_metrics(struct wipe_metrics* metrics) {
+    if (metrics) {
+        atomic_store(&metrics->state, METRICS_SLOT_RETIRED);
+    }
+}
+#endif
+
+void set_wipe_phase(struct wipe_job* job, enum wipe_phase phase) {
+    #ifndef _WIN32
+    if (job->metrics) {
+        if (phase == PHASE_FILL) {
+            atomic_store(&job->metrics->bytes_written, (unsigned long long)job->resume_offset);
+            atomic_store(&job->metrics->fill_start_bytes, (unsigned long long)job->resume_offset);
+            atomic_store(&job->metrics->phase_started_ms, monotonic_ms());
+            atomic_store(&job->metrics->pass, job->pass);
         }
+        atomic_store(&job->metrics->phase, phase);
     }
-    return -1;
+    log_wipe_event(job, EVENT_PHASE, phase, 0);
+    #else
+    (void)job;
+    (void)phase;
+    #endif
 }
 
-int erase_partition_table(const char* device_path) {
-    #ifdef _WIN32
-    HANDLE hDevice = CreateFileA(device_path, GENERIC_WRITE,
-                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
-                                 NULL, OPEN_EXISTING, 0, NULL);
+void add_bytes_written(struct wipe_job* job, unsigned long long bytes) {
+    #ifndef _WIN32
+    if (job) {
+        atomic_fetch_add_explicit(&job->bytes_written, bytes, memory_order_relaxed);
+    }
+    if (job && job->metrics) {
+        atomic_fetch_add_explicit(&job->metrics->bytes_written, bytes, memory_order_relaxed);
+    }
+    #else
+    (void)job;
+    (void)bytes;
+    #endif
+}
 
-    if (hDevice == INVALID_HANDLE_VALUE) {
-        return -1;
+#ifndef _WIN32
+int snapshot_metrics(int index, struct metrics_snapshot* snapshot) {
+    struct wipe_metrics* slot = &metrics_table[index];
+
+    unsigned before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if ((before & 1) || atomic_load(&slot->state) == METRICS_SLOT_FREE) {
+        return 0;
     }
 
-    char* zero_buffer = (char*)malloc(FILL_BUFFER_SIZE);
-    if (!zero_buffer) {
-        CloseHandle(hDevice);
-        return -1;
+    memcpy(snapshot->device, slot->device, sizeof(snapshot->device));
+    memcpy(snapshot->bus, slot->bus, sizeof(snapshot->bus));
+    snapshot->bytes_written = atomic_load_explicit(&slot->bytes_written, memory_order_relaxed);
+    snapshot->fill_start_bytes = atomic_load_explicit(&slot->fill_start_bytes, memory_order_relaxed);
+    snapshot->total_bytes = atomic_load_explicit(&slot->total_bytes, memory_order_relaxed);
+    snapshot->bytes_verified = atomic_load_explicit(&slot->bytes_verified, memory_order_relaxed);
+    snapshot->retries = atomic_load_explicit(&slot->retries, memory_order_relaxed);
+    snapshot->pass = atomic_load_explicit(&slot->pass, memory_order_relaxed);
+    snapshot->io_size = atomic_load_explicit(&slot->io_size, memory_order_relaxed);
+    snapshot->flush_ns = atomic_load_explicit(&slot->flush_ns, memory_order_relaxed);
+    snapshot->engine = atomic_load_explicit(&slot->engine, memory_order_relaxed);
+    snapshot->phase = atomic_load_explicit(&slot->phase, memory_order_relaxed);
+    snapshot->phase_started_ms = atomic_load_explicit(&slot->phase_started_ms, memory_order_relaxed);
+    snapshot->sequence = before;
+    snapshot->device[sizeof(snapshot->device) - 1] = '\0';
+    snapshot->bus[sizeof(snapshot->bus) - 1] = '\0';
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->sequence, memory_order_relaxed) == before;
+}
+
+void write_metrics_text(FILE* out, struct metrics_exporter* exporter) {
+    static const struct {
+        const char* name;
+        const char* type;
+        const char* help;
+    } families[] = {
+        { "storage_cleaner_bytes_written", "gauge", "Bytes zeroed so far in the current wipe attempt." },
+        { "storage_cleaner_device_bytes", "gauge", "Size of the device being wiped." },
+        { "storage_cleaner_bytes_verified", "gauge", "Bytes read back and found zeroed so far." },
+        { "storage_cleaner_current_mbps", "gauge", "Write throughput over the last export interval in MB/s." },
+        { "storage_cleaner_average_mbps", "gauge", "Average write throughput of the fill phase in MB/s." },
+        { "storage_cleaner_eta_seconds", "gauge", "Estimated seconds until the fill phase completes." },
+        { "storage_cleaner_retries", "gauge", "Wipe attempts restarted after a failure." },
+        { "storage_cleaner_pass", "gauge", "Overwrite pass in progress, counting from 1." },
+        { "storage_cleaner_io_size_bytes", "gauge", "Write size chosen for the device, 0 until known." },
+        { "storage_cleaner_flush_seconds_total", "counter", "Time spent waiting for writeback and cache flushes." },
+        { "storage_cleaner_engine", "gauge", "I/O engine filling the device, 1 for the engine in use." },
+        { "storage_cleaner_phase", "gauge", "Current wipe phase, 1 for the active phase." },
+    };
+    long long now = monotonic_ms();
+
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", families[f].name, families[f].help,
+                families[f].name, families[f].type);
+
+        for (int i = 0; i < MAX_TRACKED_DEVICES; i++) {
+            struct metrics_snapshot* s = &exporter->snapshots[i];
+            if (!exporter->valid[i] || (f == 10 && s->engine < 0)) {
+                continue;
+            }
+
+            double elapsed = (now - s->phase_started_ms) / 1000.0;
+            double average = s->phase == PHASE_FILL && elapsed > 0 && s->bytes_written > s->fill_start_bytes
+                             ? (s->bytes_written - s->fill_start_bytes) / elapsed / 1e6 : 0;
+            unsigned long long remaining = s->total_bytes > s->bytes_written ? s->total_bytes - s->bytes_written : 0;
+            double eta = average > 0 ? remaining / (average * 1e6) : -1;
+            if (s->phase == PHASE_DONE) {
+                eta = 0;
+            }
+
+            fprintf(out, "%s{device=\"%s\",bus=\"%s\"", families[f].name, s->device, s->bus);
+            switch (f) {
+                case 0: fprintf(out, "} %llu\n", s->bytes_written); break;
+                case 1: fprintf(out, "} %llu\n", s->total_bytes); break;
+                case 2: fprintf(out, "} %llu\n", s->bytes_verified); break;
+                case 3: fprintf(out, "} %.3f\n", exporter->current_mbps[i]); break;
+                case 4: fprintf(out, "} %.3f\n", average); break;
+                case 5: fprintf(out, "} %.0f\n", eta); break;
+                case 6: fprintf(out, "} %u\n", s->retries); break;
+                case 7: fprintf(out, "} %u\n", s->pass + 1); break;
+                case 8: fprintf(out, "} %llu\n", s->io_size); break;
+                case 9: fprintf(out, "} %.3f\n", s->flush_ns / 1e9); break;
+                case 10: fprintf(out, ",engine=\"%s\"} 1\n", engine_name((enum io_engine_kind)s->engine)); break;
+                default: fprintf(out, ",phase=\"%s\"} 1\n", wipe_phase_names[s->phase]); break;
+            }
+        }
+    }
+}
+
+void refresh_metrics(struct metrics_exporter* exporter) {
+    long long now = monotonic_ms();
+    double interval = (now - exporter->last_refresh_ms) / 1000.0;
+
+    for (int i = 0; i < MAX_TRACKED_DEVICES; i++) {
+        struct metrics_snapshot previous = exporter->snapshots[i];
+        int was_valid = exporter->valid[i];
+
+        exporter->valid[i] = snapshot_metrics(i, &exporter->snapshots[i]);
+        exporter->current_mbps[i] = 0;
+        if (exporter->valid[i] && was_valid && interval > 0 &&
+            previous.sequence == exporter->snapshots[i].sequence &&
+            exporter->snapshots[i].bytes_written >= previous.bytes_written) {
+            exporter->current_mbps[i] =
+                (exporter->snapshots[i].bytes_written - previous.bytes_written) / interval / 1e6;
+        }
+    }
+    exporter->last_refresh_ms = now;
+}
+
+int write_metrics_file(const char* path, struct metrics_exporter* exporter) {
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE* out = fopen(temp_path, "w");
+    if (!out) {
+        return -1;
+    }
+    write_metrics_text(out, exporter);
+    if (fclose(out) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return rename(temp_path, path);
+}
+
+int open_metrics_socket(const char* path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 8) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void* metrics_exporter_thread(void* arg) {
+    struct metrics_exporter* exporter = (struct metrics_exporter*)arg;
+    long long interval_ms = (long long)options.metrics_interval * 1000;
+    long long next_refresh = monotonic_ms();
+
+    while (1) {
+        long long now = monotonic_ms();
+        if (now >= next_refresh) {
+            refresh_metrics(exporter);
+            if (options.metrics_file) {
+                write_metrics_file(options.metrics_file, exporter);
+            }
+            next_refresh = now + interval_ms;
+        }
+
+        int timeout = (int)(next_refresh - monotonic_ms());
+        if (timeout < 0) {
+            timeout = 0;
+        }
+
+        if (exporter->listen_fd == -1) {
+            poll(NULL, 0, timeout);
+            continue;
+        }
+
+        struct pollfd pfd = { exporter->listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN)) {
+            int client = accept(exporter->listen_fd, NULL, NULL);
+            if (client == -1) {
+                continue;
+            }
+            // A scraper that stops reading must not hold up the refresh above;
+            // once the timeout passes the write fails and the client is dropped.
+            struct timeval send_timeout = { 1, 0 };
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+            FILE* out = fdopen(client, "w");
+            if (!out) {
+                close(client);
+                continue;
+            }
+            write_metrics_text(out, exporter);
+            fclose(out);
+        }
+    }
+    return NULL;
+}
+
+int start_metrics_exporter() {
+    if (!options.metrics_file && !options.metrics_socket) {
+        return 0;
+    }
+
+    struct metrics_exporter* exporter = (struct metrics_exporter*)calloc(1, sizeof(*exporter));
+    if (!exporter) {
+        return -1;
+    }
+    exporter->listen_fd = -1;
+    exporter->last_refresh_ms = monotonic_ms();
+
+    if (options.metrics_socket) {
+        exporter->listen_fd = open_metrics_socket(options.metrics_socket);
+        if (exporter->listen_fd == -1) {
+            free(exporter);
+            return -1;
+        }
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_exporter_thread, exporter) != 0) {
+        if (exporter->listen_fd != -1) {
+            close(exporter->listen_fd);
+        }
+        free(exporter);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+struct event_ring event_ring;
+
+void log_wipe_event(struct wipe_job* job, enum wipe_event_kind kind, int code, unsigned long long offset) {
+    if (!atomic_load_explicit(&event_ring.running, memory_order_relaxed)) {
+        return;
+    }
+
+    struct wipe_event event;
+    struct timespec now;
+    memset(&event, 0, sizeof(event));
+    clock_gettime(CLOCK_REALTIME, &now);
+    event.kind = kind;
+    event.code = code;
+    event.time_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    event.duration_ms = job->started_ms ? monotonic_ms() - job->started_ms : 0;
+    event.flush_ms = (long long)(atomic_load_explicit(&job->flush_ns, memory_order_relaxed) / 1000000);
+    event.offset = offset;
+    event.bytes = atomic_load_explicit(&job->bytes_written, memory_order_relaxed);
+    event.size = job->size;
+    event.pass = job->pass;
+    event.bad_extents = (unsigned)job->bad_extents.count;
+    event.mismatched_extents = (unsigned)job->mismatched_extents.count;
+    event.engines = job->engines_used;
+    event.fast = job->fast;
+    snprintf(event.device, sizeof(event.device), "%s", job->device_path);
+    snprintf(event.serial, sizeof(event.serial), "%s", job->serial);
+    snprintf(event.wwn, sizeof(event.wwn), "%s", job->wwn);
+    push_wipe_event(&event);
+}
+
+int push_wipe_event(const struct wipe_event* event) {
+    unsigned long long tail = atomic_load_explicit(&event_ring.tail, memory_order_relaxed);
+    while (1) {
+        struct event_slot* slot = &event_ring.slots[tail % EVENT_RING_SIZE];
+        unsigned long long sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == tail) {
+            if (atomic_compare_exchange_weak_explicit(&event_ring.tail, &tail, tail + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->event = *event;
+                atomic_store_explicit(&slot->sequence, tail + 1, memory_order_release);
+                return 0;
+            }
+        } else if (sequence < tail) {
+            atomic_fetch_add_explicit(&event_ring.dropped, 1, memory_order_relaxed);
+            return -1;
+        } else {
+            tail = atomic_load_explicit(&event_ring.tail, memory_order_relaxed);
+        }
+    }
+}
+
+int pop_wipe_event(struct wipe_event* event) {
+    struct event_slot* slot = &event_ring.slots[event_ring.head % EVENT_RING_SIZE];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != event_ring.head + 1) {
+        return -1;
+    }
+    *event = slot->event;
+    atomic_store_explicit(&slot->sequence, event_ring.head + EVENT_RING_SIZE, memory_order_release);
+    event_ring.head++;
+    return 0;
+}
+
+void write_json_string(FILE* out, const char* text) {
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fprintf(out, "\\%c", *text);
+        } else if ((unsigned char)*text < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned char)*text);
+        } else {
+            fputc(*text, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void format_utc_time(long long time_ms, char* text, size_t text_size) {
+    time_t seconds = (time_t)(time_ms / 1000);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    strftime(text, text_size, "%Y-%m-%dT%H:%M:%SZ", &utc);
+}
+
+// One JSON object per line. The line is built in memory first so its hash
+// can be chained into the next one.
+void write_journal_entry(const struct wipe_event* event) {
+    static const char* kinds[] = { "start", "phase", "error", "progress", "result", "skipped" };
+    char* line = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&line, &length);
+    if (!out) {
+        return;
+    }
+
+    char time[32];
+    format_utc_time(event->time_ms, time, sizeof(time));
+    fprintf(out, "{\"time\":\"%s\",\"event\":\"%s\",\"device\":", time, kinds[event->kind]);
+    write_json_string(out, event->device);
+    fprintf(out, ",\"serial\":");
+    write_json_string(out, event->serial);
+    fprintf(out, ",\"wwn\":");
+    write_json_string(out, event->wwn);
+    fprintf(out, ",\"size\":%llu,\"pass\":%u,\"bytes_written\":%llu,\"duration_ms\":%lld",
+            event->size, event->pass + 1, event->bytes, event->duration_ms);
+    switch (event->kind) {
+        case EVENT_PHASE:
+            fprintf(out, ",\"phase\":\"%s\"", wipe_phase_names[event->code]);
+            break;
+        case EVENT_ERROR:
+            fprintf(out, ",\"errno\":%d,\"error\":", event->code);
+            write_json_string(out, strerror(event->code));
+            fprintf(out, ",\"offset\":%llu", event->offset);
+            break;
+        case EVENT_PROGRESS:
+            fprintf(out, ",\"offset\":%llu", event->offset);
+            break;
+        case EVENT_RESULT:
+            fprintf(out, ",\"result\":\"%s\",\"bad_extents\":%u,\"verify_mismatches\":%u,\"flush_ms\":%lld",
+                    wipe_phase_names[event->code], event->bad_extents, event->mismatched_extents, event->flush_ms);
+            if (event->engines) {
+                char engines[64];
+                format_engines(event->engines, engines, sizeof(engines));
+                fprintf(out, ",\"engines\":\"%s\"", engines);
+            }
+            break;
+        case EVENT_SKIPPED: {
+            char wiped[32];
+            format_utc_time((long long)event->offset * 1000, wiped, sizeof(wiped));
+            fprintf(out, ",\"last_wipe\":\"%s\"", wiped);
+            break;
+        }
+    }
+    fclose(out);
+
+    event_ring.chain = hash_bytes(line, length, event_ring.chain);
+    fprintf(event_ring.journal, "%s,\"chain\":\"%016llx\"}\n", line, event_ring.chain);
+    free(line);
+}
+
+struct certificate_key certificate_key;
+
+// A plain-text record of one finished wipe, written to a temporary name and
+// renamed so a certificate is either complete or absent. The digest covers
+// every line above it, and journal-chain ties it to the journal entry of
+// the same result; both only catch accidental damage. With --certificate-key
+// the last line is an HMAC-SHA256 of all the others, which an edit cannot
+// keep valid without the key.
+int write_wipe_certificate(const struct wipe_event* event) {
+    char started[32];
+    char finished[32];
+    char host[256] = "";
+    format_utc_time(event->time_ms - event->duration_ms, started, sizeof(started));
+    format_utc_time(event->time_ms, finished, sizeof(finished));
+    gethostname(host, sizeof(host) - 1);
+
+    const char* name = strrchr(event->device, '/');
+    name = name ? name + 1 : event->device;
+    unsigned long long tag = hash_bytes(event->device, strlen(event->device), 0xcbf29ce484222325ULL);
+    tag = hash_bytes(event->serial, strlen(event->serial), tag);
+
+    char path[PATH_MAX];
+    char temporary[PATH_MAX + 8];
+    snprintf(path, sizeof(path), "%s/certificates/%s-%lld-%08llx.txt", options.state_dir, name,
+             event->time_ms / 1000, tag & 0xffffffffULL);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    char* body = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&body, &length);
+    if (!out) {
+        return -1;
+    }
+    fprintf(out, "storage-cleaner wipe certificate\n"
+                 "host: %s\n"
+                 "device: %s\n"
+                 "serial: %s\n"
+                 "wwn: %s\n"
+                 "size: %llu bytes\n",
+            host, event->device, event->serial[0] ? event->serial : "unknown",
+            event->wwn[0] ? event->wwn : "unknown", event->size);
+    if (event->fast) {
+        fprintf(out, "method: partition tables and metadata signatures zeroed\n");
+    } else {
+        fprintf(out, "method: overwrite, %u pass(es): %s\n", options.pass_count, options.pattern_spec);
+    }
+    if (event->engines) {
+        char engines[64];
+        format_engines(event->engines, engines, sizeof(engines));
+        fprintf(out, "engine: %s\n", engines);
+    }
+    fprintf(out, "verified: %s\n"
+                 "started: %s\n"
+                 "finished: %s\n"
+                 "duration: %.3f s\n"
+                 "flushing: %.3f s\n"
+                 "bytes written: %llu\n"
+                 "unwritable extents: %u\n"
+                 "verify mismatches: %u\n"
+                 "result: %s\n"
+                 "journal-chain: %016llx\n",
+            options.verify && !event->fast ? "read back" : "no", started, finished, event->duration_ms / 1000.0,
+            event->flush_ms / 1000.0, event->bytes, event->bad_extents, event->mismatched_extents, wipe_phase_names[event->code],
+            event_ring.chain);
+    fflush(out);
+    fprintf(out, "digest: %016llx\n", hash_bytes(body, length, 0xcbf29ce484222325ULL));
+    fclose(out);
+
+    FILE* file = fopen(temporary, "w");
+    if (!file) {
+        free(body);
+        return -1;
+    }
+    fwrite(body, 1, length, file);
+    if (certificate_key.loaded) {
+        unsigned char mac[32];
+        hmac_sha256(certificate_key.bytes, body, length, mac);
+        fprintf(file, "signature: hmac-sha256 ");
+        for (int i = 0; i < 32; i++) {
+            fprintf(file, "%02x", mac[i]);
+        }
+        fputc('\n', file);
+    }
+    free(body);
+    int result = fflush(file) == 0 && fsync(fileno(file)) == 0 ? 0 : -1;
+    if (fclose(file) != 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(temporary, path) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(temporary);
+    }
+    return result;
+}
+
+void* event_logger_thread(void* arg) {
+    (void)arg;
+    struct wipe_event event;
+
+    while (1) {
+        int drained = 0;
+        while (pop_wipe_event(&event) == 0) {
+            write_journal_entry(&event);
+            if (event.kind == EVENT_RESULT) {
+                fflush(event_ring.journal);
+                write_wipe_certificate(&event);
+            }
+            drained++;
+        }
+
+        unsigned long long dropped = atomic_load(&event_ring.dropped);
+        if (dropped != event_ring.reported_drops) {
+            fprintf(event_ring.journal, "{\"event\":\"dropped\",\"count\":%llu}\n",
+                    dropped - event_ring.reported_drops);
+            event_ring.reported_drops = dropped;
+        }
+        if (drained > 0) {
+            fflush(event_ring.journal);
+            block_flush(fileno(event_ring.journal));
+        } else if (atomic_load(&event_ring.stopping)) {
+            break;
+        } else {
+            poll(NULL, 0, EVENT_POLL_MS);
+        }
+    }
+    return NULL;
+}
+
+// The journal and certificates live in the state directory; without one
+// nothing is logged and log_wipe_event returns straight away.
+int start_event_logger() {
+    if (!options.state_dir) {
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/certificates", options.state_dir);
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/journal", options.state_dir);
+    int fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // Carry the chain on from the last entry a previous run wrote.
+    event_ring.chain = 0xcbf29ce484222325ULL;
+    char tail[4096];
+    off_t length = lseek(fd, 0, SEEK_END);
+    off_t from = length > (off_t)sizeof(tail) - 1 ? length - (off_t)sizeof(tail) + 1 : 0;
+    ssize_t count = length > 0 ? pread(fd, tail, (size_t)(length - from), from) : 0;
+    if (count > 0) {
+        tail[count] = '\0';
+        for (char* found = strstr(tail, "\"chain\":\""); found; found = strstr(found + 1, "\"chain\":\"")) {
+            event_ring.chain = strtoull(found + 9, NULL, 16);
+        }
+    }
+
+    if (!(event_ring.journal = fdopen(fd, "a"))) {
+        close(fd);
+        return -1;
+    }
+    for (unsigned i = 0; i < EVENT_RING_SIZE; i++) {
+        atomic_init(&event_ring.slots[i].sequence, i);
+    }
+    if (pthread_create(&event_ring.thread, NULL, event_logger_thread, NULL) != 0) {
+        fclose(event_ring.journal);
+        return -1;
+    }
+    atomic_store(&event_ring.running, 1);
+    return 0;
+}
+
+void stop_event_logger() {
+    if (!atomic_load(&event_ring.running)) {
+        return;
+    }
+    atomic_store(&event_ring.running, 0);
+    atomic_store(&event_ring.stopping, 1);
+    pthread_join(event_ring.thread, NULL);
+    fclose(event_ring.journal);
+}
+#endif
+
+#ifndef _WIN32
+unsigned long long hash_bytes(const void* data, size_t length, unsigned long long hash) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+const uint32_t sha256_rounds[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+uint32_t rotate_right(uint32_t value, unsigned count) {
+    return (value >> count) | (value << (32 - count));
+}
+
+void sha256_init(struct sha256* sha) {
+    const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+    sha->used = 0;
+}
+
+void sha256_block(struct sha256* sha, const unsigned char* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    // v holds a..h; each round shifts them down one and replaces a and e.
+    uint32_t v[8];
+    memcpy(v, sha->state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotate_right(v[4], 6) ^ rotate_right(v[4], 11) ^ rotate_right(v[4], 25);
+        uint32_t choose = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + choose + sha256_rounds[i] + w[i];
+        uint32_t s0 = rotate_right(v[0], 2) ^ rotate_right(v[0], 13) ^ rotate_right(v[0], 22);
+        uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + s0 + majority;
+    }
+    for (int i = 0; i < 8; i++) {
+        sha->state[i] += v[i];
+    }
+}
+
+void sha256_update(struct sha256* sha, const void* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    sha->length += length;
+    while (length > 0) {
+        size_t take = 64 - sha->used < length ? 64 - sha->used : length;
+        memcpy(sha->block + sha->used, bytes, take);
+        sha->used += take;
+        bytes += take;
+        length -= take;
+        if (sha->used == 64) {
+            sha256_block(sha, sha->block);
+            sha->used = 0;
+        }
+    }
+}
+
+void sha256_final(struct sha256* sha, unsigned char digest[32]) {
+    unsigned long long bits = sha->length * 8;
+    unsigned char padding[72] = { 0x80 };
+    size_t padding_length = (sha->used < 56 ? 56 : 120) - sha->used;
+    for (int i = 0; i < 8; i++) {
+        padding[padding_length + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256_update(sha, padding, padding_length + 8);
+    for (int i = 0; i < 32; i++) {
+        digest[i] = (unsigned char)(sha->state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+// RFC 2104 HMAC over a key already brought to the block size.
+void hmac_sha256(const unsigned char key[64], const void* data, size_t length, unsigned char mac[32]) {
+    unsigned char pad[64];
+    struct sha256 sha;
+
+    for (int i = 0; i < 64; i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+    sha256_init(&sha);
+    sha256_update(&sha, pad, sizeof(pad));
+    sha256_update(&sha, data, length);
+    sha256_final(&sha, mac);
+
+    for (int i = 0; i < 64; i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+    sha256_init(&sha);
+    sha256_update(&sha, pad, sizeof(pad));
+    sha256_update(&sha, mac, 32);
+    sha256_final(&sha, mac);
+}
+
+// The key is the file's contents less one trailing newline, so both a
+// random binary key and `echo secret > key` work. A key longer than a block
+// is hashed down first, as HMAC specifies.
+int load_certificate_key() {
+    if (!options.certificate_key) {
+        return 0;
+    }
+    FILE* file = fopen(options.certificate_key, "r");
+    if (!file) {
+        return -1;
+    }
+    unsigned char key[4096];
+    size_t length = fread(key, 1, sizeof(key), file);
+    int too_long = length == sizeof(key) && fgetc(file) != EOF;
+    fclose(file);
+    if (length > 0 && key[length - 1] == '\n') {
+        length--;
+    }
+    if (length == 0 || too_long) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(certificate_key.bytes, 0, sizeof(certificate_key.bytes));
+    if (length > sizeof(certificate_key.bytes)) {
+        struct sha256 sha;
+        sha256_init(&sha);
+        sha256_update(&sha, key, length);
+        sha256_final(&sha, certificate_key.bytes);
+    } else {
+        memcpy(certificate_key.bytes, key, length);
+    }
+    memset(key, 0, sizeof(key));
+    certificate_key.loaded = 1;
+    return 0;
+}
+
+int wipe_identity(struct wipe_job* job, char* key, size_t key_size) {
+    if (job->serial[0] == '\0' && job->wwn[0] == '\0') {
+        return -1;
+    }
+    snprintf(key, key_size, "%s|%s|%llu", job->serial, job->wwn, job->size);
+    return 0;
+}
+
+unsigned long long checkpoint_seed(const char* key, long long started_at) {
+    return hash_bytes(key, strlen(key), 0xcbf29ce484222325ULL) ^ (unsigned long long)started_at;
+}
+
+int checkpoint_path(struct wipe_job* job, char* path, size_t path_size, char* key, size_t key_size) {
+    if (!options.state_dir || wipe_identity(job, key, key_size) != 0) {
+        return -1;
+    }
+    unsigned long long hash = hash_bytes(key, strlen(key), 0xcbf29ce484222325ULL);
+    snprintf(path, path_size, "%s/%016llx.checkpoint", options.state_dir, hash);
+    return 0;
+}
+
+int load_checkpoint(struct wipe_job* job, unsigned* pass, off_t* offset) {
+    char path[PATH_MAX];
+    char key[512];
+    if (checkpoint_path(job, path, sizeof(path), key, sizeof(key)) != 0) {
+        return -1;
+    }
+
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    char line[600];
+    char stored_key[sizeof(line)] = {0};
+    char stored_plan[sizeof(line)] = "zero";
+    unsigned long stored_pass = 0;
+    long long stored_offset = -1;
+    long long stored_started = 0;
+    unsigned long long stored_fingerprint = 0;
+    int has_fingerprint = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "key=", 4) == 0) {
+            snprintf(stored_key, sizeof(stored_key), "%s", line + 4);
+        } else if (strncmp(line, "plan=", 5) == 0) {
+            snprintf(stored_plan, sizeof(stored_plan), "%s", line + 5);
+        } else if (strncmp(line, "pass=", 5) == 0) {
+            stored_pass = strtoul(line + 5, NULL, 10);
+        } else if (strncmp(line, "offset=", 7) == 0) {
+            stored_offset = strtoll(line + 7, NULL, 10);
+        } else if (strncmp(line, "started=", 8) == 0) {
+            stored_started = strtoll(line + 8, NULL, 10);
+        } else if (strncmp(line, "fingerprint=", 12) == 0) {
+            stored_fingerprint = strtoull(line + 12, NULL, 16);
+            has_fingerprint = 1;
+        }
+    }
+    fclose(file);
+
+    // Progress made under a different pass list does not carry over.
+    if (strcmp(stored_key, key) != 0 || strcmp(stored_plan, options.pattern_spec) != 0 ||
+        stored_pass >= options.pass_count || stored_offset < 0 ||
+        (unsigned long long)stored_offset > job->size || !has_fingerprint || stored_started <= 0) {
+        return -1;
+    }
+
+    // Identity alone does not prove this is the disk that was being wiped:
+    // cheap bridges give different disks the same serial, and the disk may
+    // have been written elsewhere since. The wiped part has to read back as
+    // it did, within the time a finished wipe would be trusted for.
+    long long age = (long long)time(NULL) - stored_started;
+    unsigned long long fingerprint;
+    if ((options.rewipe_after > 0 && (age < 0 || age >= options.rewipe_after * 3600LL)) ||
+        fingerprint_prefix(job, checkpoint_seed(key, stored_started), (off_t)stored_offset, &fingerprint) != 0 ||
+        fingerprint != stored_fingerprint) {
+        printf("%s: checkpoint at %lld MiB is stale or the disk changed since, starting over\n",
+               job->device_path, stored_offset >> 20);
+        fflush(stdout);
+        return -1;
+    }
+    job->checkpoint_started = stored_started;
+    *pass = (unsigned)stored_pass;
+    *offset = (off_t)stored_offset;
+    return 0;
+}
+
+// The caller must have made the device data up to offset durable first,
+// since that prefix is fingerprinted for load_checkpoint() to check.
+int save_checkpoint(struct wipe_job* job, off_t offset) {
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX + 8];
+    char key[512];
+    if (checkpoint_path(job, path, sizeof(path), key, sizeof(key)) != 0) {
+        return -1;
+    }
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    unsigned long long fingerprint;
+    if (fingerprint_prefix(job, checkpoint_seed(key, job->checkpoint_started), offset, &fingerprint) != 0) {
+        return -1;
+    }
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    char record[1300];
+    int length = snprintf(record, sizeof(record),
+                          "key=%s\nplan=%s\npass=%u\noffset=%lld\nstarted=%lld\nfingerprint=%016llx\n",
+                          key, options.pattern_spec, job->pass, (long long)offset,
+                          job->checkpoint_started, fingerprint);
+    int result = length > 0 && length < (int)sizeof(record) &&
+                 write(fd, record, (size_t)length) == length && fsync(fd) == 0 ? 0 : -1;
+    close(fd);
+
+    if (result != 0 || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+
+    int dir_fd = open(options.state_dir, O_RDONLY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+void clear_checkpoint(struct wipe_job* job) {
+    char path[PATH_MAX];
+    char key[512];
+    if (checkpoint_path(job, path, sizeof(path), key, sizeof(key)) == 0) {
+        unlink(path);
+    }
+}
+
+// What a recorded wipe has to match to stand in for a new one.
+void wipe_plan(char* text, size_t text_size) {
+    snprintf(text, text_size, "%s%s", options.pattern_spec, options.verify ? "+verify" : "");
+}
+
+// Hashes the first and last FINGERPRINT_EDGE bytes, where partition tables
+// and file system headers go, and FINGERPRINT_SAMPLES blocks at offsets
+// drawn from seed. A few milliseconds of reads on any disk.
+int fingerprint_device(struct wipe_job* job, unsigned long long seed, unsigned long long* fingerprint) {
+    if (job->size < FINGERPRINT_EDGE * 2) {
+        return -1;
+    }
+    return fingerprint_prefix(job, seed, (off_t)job->size, fingerprint);
+}
+
+// The same over the first end bytes only, for the part of a disk a
+// checkpoint says is already wiped. A prefix too short for both edges is
+// hashed from its start alone.
+int fingerprint_prefix(struct wipe_job* job, unsigned long long seed, off_t end, unsigned long long* fingerprint) {
+    int fd = open_verify_fd(job->device_path);
+    if (fd == -1) {
+        return -1;
+    }
+    char* buffer = alloc_io_buffer(FINGERPRINT_EDGE, FINGERPRINT_BLOCK);
+    if (!buffer) {
+        device_close(fd);
+        return -1;
+    }
+
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    int result = 0;
+    for (int i = 0; i < FINGERPRINT_SAMPLES + 2 && result == 0; i++) {
+        off_t offset;
+        size_t length = FINGERPRINT_BLOCK;
+        if (i == 0) {
+            offset = 0;
+            length = end < FINGERPRINT_EDGE ? (size_t)(end / FINGERPRINT_BLOCK * FINGERPRINT_BLOCK) : FINGERPRINT_EDGE;
+        } else if (i == 1) {
+            if (end < FINGERPRINT_EDGE * 2) {
+                continue;
+            }
+            offset = end - FINGERPRINT_EDGE;
+            length = FINGERPRINT_EDGE;
+        } else if (end >= FINGERPRINT_BLOCK) {
+            offset = (off_t)(splitmix64(&seed) % (unsigned long long)(end / FINGERPRINT_BLOCK)) * FINGERPRINT_BLOCK;
+        } else {
+            break;
+        }
+        if (length == 0) {
+            continue;
+        }
+
+        ssize_t bytes_read;
+        do {
+            bytes_read = device_pread(fd, buffer, length, offset);
+        } while (bytes_read == -1 && errno == EINTR);
+        if (bytes_read != (ssize_t)length) {
+            result = -1;
+        }
+        hash = hash_bytes(buffer, length, hash);
+    }
+
+    free(buffer);
+    device_close(fd);
+    *fingerprint = hash;
+    return result;
+}
+
+pthread_mutex_t wiped_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int read_wiped_index(struct wiped_entry* entries, int max_count) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/wiped.index", options.state_dir);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+
+    char line[800];
+    int count = 0;
+    while (count < max_count && fgets(line, sizeof(line), file)) {
+        struct wiped_entry* entry = &entries[count];
+        int key_start = 0;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%lld %llx %127s %n", &entry->wiped_at, &entry->fingerprint, entry->plan, &key_start) == 3 &&
+            key_start > 0) {
+            snprintf(entry->key, sizeof(entry->key), "%s", line + key_start);
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+// A disk is left alone when it was wiped the same way less than
+// options.rewipe_after hours ago and the blocks sampled then still hash
+// the same. Any write since then almost certainly touches a partition
+// table at either end, or shows up in the samples.
+int recently_wiped(struct wipe_job* job, long long* wiped_at) {
+    char key[512];
+    char plan[128];
+    if (!options.state_dir || options.rewipe_after == 0 || wipe_identity(job, key, sizeof(key)) != 0) {
+        return 0;
+    }
+    wipe_plan(plan, sizeof(plan));
+
+    struct wiped_entry* entries = (struct wiped_entry*)malloc(MAX_WIPED_ENTRIES * sizeof(*entries));
+    if (!entries) {
+        return 0;
+    }
+    pthread_mutex_lock(&wiped_index_lock);
+    int count = read_wiped_index(entries, MAX_WIPED_ENTRIES);
+    pthread_mutex_unlock(&wiped_index_lock);
+
+    long long now = (long long)time(NULL);
+    int clean = 0;
+    for (int i = count - 1; i >= 0; i--) {
+        struct wiped_entry* entry = &entries[i];
+        if (strcmp(entry->key, key) != 0) {
+            continue;
+        }
+        unsigned long long fingerprint;
+        unsigned long long seed = hash_bytes(key, strlen(key), 0xcbf29ce484222325ULL) ^ (unsigned long long)entry->wiped_at;
+        clean = strcmp(entry->plan, plan) == 0 && now - entry->wiped_at < options.rewipe_after * 3600LL &&
+                fingerprint_device(job, seed, &fingerprint) == 0 && fingerprint == entry->fingerprint;
+        *wiped_at = entry->wiped_at;
+        break;
+    }
+    free(entries);
+    return clean;
+}
+
+// Rewrites the index with this disk's entry replaced and expired ones
+// dropped, through a temporary file like the checkpoints.
+void record_wiped_device(struct wipe_job* job) {
+    char key[512];
+    if (!options.state_dir || options.rewipe_after == 0 || wipe_identity(job, key, sizeof(key)) != 0) {
+        return;
+    }
+    struct wiped_entry* entries = (struct wiped_entry*)malloc((MAX_WIPED_ENTRIES + 1) * sizeof(*entries));
+    if (!entries) {
+        return;
+    }
+
+    struct wiped_entry* entry = &entries[0];
+    entry->wiped_at = (long long)time(NULL);
+    unsigned long long seed = hash_bytes(key, strlen(key), 0xcbf29ce484222325ULL) ^ (unsigned long long)entry->wiped_at;
+    if (fingerprint_device(job, seed, &entry->fingerprint) != 0) {
+        free(entries);
+        return;
+    }
+    wipe_plan(entry->plan, sizeof(entry->plan));
+    snprintf(entry->key, sizeof(entry->key), "%s", key);
+
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX + 8];
+    snprintf(path, sizeof(path), "%s/wiped.index", options.state_dir);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    pthread_mutex_lock(&wiped_index_lock);
+    int count = read_wiped_index(entries + 1, MAX_WIPED_ENTRIES) + 1;
+    FILE* file = fopen(temp_path, "w");
+    if (file) {
+        // Oldest first, so the newest entry is the one a lookup finds, and
+        // the oldest make room when the index is full.
+        for (int i = 1; i <= count; i++) {
+            struct wiped_entry* kept = &entries[i % count];
+            if (i < count && (i < count - MAX_WIPED_ENTRIES + 1 || strcmp(kept->key, key) == 0 ||
+                              entry->wiped_at - kept->wiped_at >= options.rewipe_after * 3600LL)) {
+                continue;
+            }
+            fprintf(file, "%lld %016llx %s %s\n", kept->wiped_at, kept->fingerprint, kept->plan, kept->key);
+        }
+        int result = fflush(file) == 0 && fsync(fileno(file)) == 0 ? 0 : -1;
+        if (fclose(file) != 0 || result != 0 || rename(temp_path, path) != 0) {
+            unlink(temp_path);
+        }
+    }
+    pthread_mutex_unlock(&wiped_index_lock);
+    free(entries);
+}
+
+// Called by the write loops with the offset below which every byte of the
+// fill is known to be written. A retry continues from here, and every
+// CHECKPOINT_INTERVAL bytes the position is flushed to the journal so a
+// restart or re-plug continues from it too.
+void record_fill_progress(struct wipe_target* target, off_t offset) {
+    struct wipe_job* job = target->job;
+    bound_dirty_pages(target, offset);
+    if (target->range_written) {
+        atomic_store_explicit(target->range_written, (long long)offset, memory_order_release);
+        return;
+    }
+    if (!target->track_progress || offset <= job->resume_offset) {
+        return;
+    }
+
+    job->resume_offset = offset;
+    if (target->verifier) {
+        atomic_store_explicit(&target->verifier->written, (long long)offset, memory_order_release);
+    }
+    if (offset - job->checkpoint_offset >= CHECKPOINT_INTERVAL || offset == target->size) {
+        if (flush_target(target) == 0 && save_checkpoint(job, offset) == 0) {
+            job->checkpoint_offset = offset;
+        }
+        log_wipe_event(job, EVENT_PROGRESS, 0, (unsigned long long)offset);
+    }
+}
+
+// The durability barrier: returns once everything written so far is on
+// stable media, through the device's volatile cache as well as the page
+// cache. The wait is what the flush metrics count.
+int flush_target(struct wipe_target* target) {
+    long long started = monotonic_ns();
+    int result = device_flush(target->fd);
+    add_flush_time(target->job, started);
+    return result;
+}
+
+void add_flush_time(struct wipe_job* job, long long started_ns) {
+    long long elapsed = monotonic_ns() - started_ns;
+    atomic_fetch_add_explicit(&job->flush_ns, (unsigned long long)elapsed, memory_order_relaxed);
+    if (job->metrics) {
+        atomic_fetch_add_explicit(&job->metrics->flush_ns, (unsigned long long)elapsed, memory_order_relaxed);
+    }
+}
+
+// Buffered writes only: once options.dirty_window bytes past dirty_start
+// are dirty, start their writeback, then wait for the window before them
+// and drop it from the page cache. At most two windows per writer are
+// ever dirty or cached, rather than whatever the kernel lets pile up.
+void bound_dirty_pages(struct wipe_target* target, off_t offset) {
+    if (target->direct || options.dirty_window == 0) {
+        return;
+    }
+    if (offset < target->dirty_start) {
+        target->dirty_start = offset;
+        target->writeback_start = offset;
+        return;
+    }
+    if ((unsigned long long)(offset - target->dirty_start) < options.dirty_window) {
+        return;
+    }
+
+    #ifdef __APPLE__
+    flush_target(target);
+    #else
+    off_t start = target->dirty_start;
+    sync_file_range(target->fd, start, offset - start, SYNC_FILE_RANGE_WRITE);
+    if (target->writeback_start < start) {
+        long long started = monotonic_ns();
+        sync_file_range(target->fd, target->writeback_start, start - target->writeback_start,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        add_flush_time(target->job, started);
+        posix_fadvise(target->fd, target->writeback_start, start - target->writeback_start, POSIX_FADV_DONTNEED);
+    }
+    target->writeback_start = start;
+    #endif
+    target->dirty_start = offset;
+}
+
+// Power-of-two write sizes from the device's minimum I/O size up to twice
+// its largest request, each rounded up to whole RAID stripes when the
+// device reports an optimal I/O size.
+int io_size_candidates(struct wipe_target* target, size_t* sizes, int max_count) {
+    unsigned long long minimum = 0;
+    unsigned long long optimal = 0;
+    unsigned long long max_sectors_kb = 0;
+    #ifndef __APPLE__
+    struct stat st;
+    if (fstat(target->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        read_queue_limit(st.st_rdev, "minimum_io_size", &minimum);
+        read_queue_limit(st.st_rdev, "optimal_io_size", &optimal);
+        read_queue_limit(st.st_rdev, "max_sectors_kb", &max_sectors_kb);
+    }
+    #else
+    (void)target;
+    #endif
+
+    size_t lowest = minimum > MIN_CALIBRATION_IO_SIZE ? (size_t)minimum : MIN_CALIBRATION_IO_SIZE;
+    size_t highest = 4 * FILL_BUFFER_SIZE;
+    if (max_sectors_kb > 0) {
+        highest = max_sectors_kb * 2048 > FILL_BUFFER_SIZE ? (size_t)(max_sectors_kb * 2048) : FILL_BUFFER_SIZE;
+    }
+    if (highest > MAX_IO_SIZE) {
+        highest = MAX_IO_SIZE;
+    }
+
+    int count = 0;
+    for (size_t size = lowest; size <= highest && count < max_count; size *= 2) {
+        size_t candidate = size;
+        if (optimal > 0 && candidate % optimal != 0) {
+            candidate = (candidate / optimal + 1) * optimal;
+        }
+        candidate = (candidate + 4095) / 4096 * 4096;
+        if (candidate > MAX_IO_SIZE) {
+            break;
+        }
+        if (count == 0 || candidate > sizes[count - 1]) {
+            sizes[count++] = candidate;
+        }
+    }
+    if (count == 0) {
+        sizes[count++] = FILL_BUFFER_SIZE;
+    }
+    return count;
+}
+
+int offload_expected(struct wipe_target* target, const struct wipe_pass* pass) {
+    #ifndef __APPLE__
+    struct offload_caps caps;
+    return pass->kind == PATTERN_ZERO && options.offload &&
+           probe_offload_caps(target->job->device_path, &caps) == 0;
+    #else
+    (void)target;
+    (void)pass;
+    return 0;
+    #endif
+}
+
+// Writes the start of the pass at each candidate size for an equal share of
+// CALIBRATION_MS and keeps the fastest. The writes are real fill progress,
+// so start moves past them.
+int calibrate_io_size(struct wipe_target* target, char* buffer, const size_t* sizes, int count, off_t* start) {
+    struct wipe_job* job = target->job;
+    long long slice_ns = CALIBRATION_MS * 1000000LL / count;
+    double best_rate = 0;
+    size_t best = sizes[0];
+
+    for (int i = 0; i < count && *start < target->size; i++) {
+        off_t batch = (off_t)sizes[i] * options.queue_depth * 4;
+        if (batch < CALIBRATION_BATCH) {
+            batch = CALIBRATION_BATCH;
+        }
+
+        off_t from = *start;
+        long long began = monotonic_ns();
+        long long elapsed = 0;
+        while (*start < target->size && elapsed < slice_ns) {
+            off_t end = target->size - *start > batch ? *start + batch : target->size;
+            if (fill_target_range(target, buffer, sizes[i], *start, end, job->engine) != 0) {
+                return -1;
+            }
+            *start = end;
+            elapsed = monotonic_ns() - began;
+        }
+
+        double rate = elapsed > 0 ? (double)(*start - from) / (double)elapsed : 0;
+        if (rate > best_rate) {
+            best_rate = rate;
+            best = sizes[i];
+        }
+    }
+
+    job->io_size = best;
+    if (job->metrics) {
+        atomic_store(&job->metrics->io_size, (unsigned long long)best);
+    }
+    return 0;
+}
+
+// The engine that wins depends on the kind of device, on whether the page
+// cache is in the way and on whether the pass can be spliced from
+// /dev/zero, so all three go into the key.
+void engine_class(struct wipe_target* target, char* text, size_t text_size) {
+    int zero = !target->pass || target->pass->kind == PATTERN_ZERO;
+    snprintf(text, text_size, "%s/%s/%s", target->job->device_class[0] ? target->job->device_class : "disk",
+             target->direct ? "direct" : "buffered", zero ? "zero" : "data");
+}
+
+struct engine_choice {
+    char device_class[64];
+    enum io_engine_kind kind;
+};
+
+struct engine_choice engine_choices[MAX_ENGINE_CLASSES];
+unsigned engine_choice_count;
+pthread_mutex_t engine_choice_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int find_engine_choice(const char* device_class, enum io_engine_kind* kind) {
+    int found = 0;
+    pthread_mutex_lock(&engine_choice_lock);
+    for (unsigned i = 0; i < engine_choice_count && !found; i++) {
+        if (strcmp(engine_choices[i].device_class, device_class) == 0) {
+            *kind = engine_choices[i].kind;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&engine_choice_lock);
+    return found;
+}
+
+void remember_engine_choice(const char* device_class, enum io_engine_kind kind) {
+    enum io_engine_kind existing;
+    if (find_engine_choice(device_class, &existing)) {
+        return;
+    }
+    pthread_mutex_lock(&engine_choice_lock);
+    if (engine_choice_count < MAX_ENGINE_CLASSES) {
+        struct engine_choice* choice = &engine_choices[engine_choice_count++];
+        snprintf(choice->device_class, sizeof(choice->device_class), "%s", device_class);
+        choice->kind = kind;
+    }
+    pthread_mutex_unlock(&engine_choice_lock);
+}
+
+// Gives every usable engine an equal share of ENGINE_PROBE_MS on the start
+// of the device, the way calibrate_io_size() does for write sizes, so the
+// measurement is part of the pass rather than extra I/O.
+int probe_io_engines(struct wipe_target* target, char* buffer, size_t buffer_size, off_t* start,
+                     enum io_engine_kind* chosen) {
+    enum io_engine_kind candidates[IO_ENGINE_AUTO];
+    int count = 0;
+    for (int kind = 0; kind < IO_ENGINE_AUTO; kind++) {
+        if (engine_usable((enum io_engine_kind)kind, target)) {
+            candidates[count++] = (enum io_engine_kind)kind;
+        }
+    }
+
+    *chosen = IO_ENGINE_WRITE;
+    long long slice_ns = count > 0 ? ENGINE_PROBE_MS * 1000000LL / count : 0;
+    double best_rate = 0;
+    for (int i = 0; i < count && *start < target->size; i++) {
+        off_t from = *start;
+        long long began = monotonic_ns();
+        long long elapsed = 0;
+        while (*start < target->size && elapsed < slice_ns) {
+            off_t end = target->size - *start > CALIBRATION_BATCH ? *start + CALIBRATION_BATCH : target->size;
+            if (fill_target_range(target, buffer, buffer_size, *start, end, candidates[i]) != 0) {
+                return -1;
+            }
+            *start = end;
+            elapsed = monotonic_ns() - began;
+        }
+
+        double rate = elapsed > 0 ? (double)(*start - from) / (double)elapsed : 0;
+        if (rate > best_rate) {
+            best_rate = rate;
+            *chosen = candidates[i];
+        }
+    }
+    return 0;
+}
+
+// Settles the engine for the pass about to run. With --engine auto, the
+// first device of a class is probed and later ones reuse its result; where
+// a probe would measure nothing useful, io_uring is used if it can be.
+// Regular files are never probed, since the probe would fill their holes.
+int select_io_engine(struct wipe_target* target, char* buffer, size_t buffer_size, off_t* start) {
+    struct wipe_job* job = target->job;
+    enum io_engine_kind chosen = options.engine;
+
+    if (chosen == IO_ENGINE_AUTO) {
+        char device_class[64];
+        engine_class(target, device_class, sizeof(device_class));
+        if (target->regular_file) {
+            // A probe writes solid data from the start and would fill holes
+            // before fill_file_extents could skip them, so files get a fixed
+            // engine: the page cache already holds them, which suits mmap.
+            chosen = engine_usable(IO_ENGINE_MMAP, target) ? IO_ENGINE_MMAP : IO_ENGINE_URING;
+        } else if (find_engine_choice(device_class, &chosen)) {
+            // Another device of the class has already been measured.
+        } else if (offload_expected(target, target->pass) || rate_limited()) {
+            chosen = IO_ENGINE_URING;
+        } else {
+            if (probe_io_engines(target, buffer, buffer_size, start, &chosen) != 0) {
+                return -1;
+            }
+            remember_engine_choice(device_class, chosen);
+        }
+    }
+    if (!engine_usable(chosen, target)) {
+        chosen = IO_ENGINE_WRITE;
+    }
+
+    job->engine = chosen;
+    job->engines_used |= 1u << chosen;
+    if (job->metrics) {
+        atomic_store(&job->metrics->engine, (int)chosen);
+    }
+    return 0;
+}
+
+void format_engines(unsigned engines, char* text, size_t text_size) {
+    size_t length = 0;
+    text[0] = '\0';
+    for (int kind = 0; kind < IO_ENGINE_AUTO && length < text_size; kind++) {
+        if (engines & (1u << kind)) {
+            length += (size_t)snprintf(text + length, text_size - length, "%s%s", length ? "+" : "",
+                                       engine_name((enum io_engine_kind)kind));
+        }
+    }
+}
+#endif
+
+int check_permissions() {
+    #ifdef _WIN32
+    HANDLE hToken = NULL;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken)) {
+        return 0;
+    }
+
+    TOKEN_ELEVATION elevation;
+    DWORD dwSize = sizeof(TOKEN_ELEVATION);
+    if (!GetTokenInformation(hToken, TokenElevation, &elevation, sizeof(elevation), &dwSize)) {
+        CloseHandle(hToken);
+        return 0;
+    }
+
+    CloseHandle(hToken);
+    return elevation.TokenIsElevated;
+    #else
+    return geteuid() == 0;
+    #endif
+}
+
+int device_still_exists(const char* device_path) {
+    #ifdef _WIN32
+    HANDLE hDevice = CreateFileA(device_path, GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    CloseHandle(hDevice);
+    return 1;
+    #else
+    return backend_for_path(device_path)->exists(device_path);
+    #endif
+}
+
+#ifndef _WIN32
+int wipe_cancelled(struct wipe_job* job) {
+    return atomic_load_explicit(&job->cancelled, memory_order_relaxed);
+}
+#endif
+
+int wipe_device(struct wipe_job* job) {
+    job->fast = options.fast;
+    #ifndef _WIN32
+    unsigned pass = 0;
+    off_t checkpoint = 0;
+    long long wiped_at = 0;
+    job->checkpoint_started = (long long)time(NULL);
+    if (load_checkpoint(job, &pass, &checkpoint) == 0) {
+        job->pass = pass;
+        job->resume_offset = checkpoint;
+        job->checkpoint_offset = checkpoint;
+    } else if (options.target_count == 0 && !options.fast && recently_wiped(job, &wiped_at)) {
+        // A re-plug of a disk that finished moments ago, not a new disk.
+        printf("%s: wiped %lld min ago and unchanged since, skipping\n", job->device_path,
+               ((long long)time(NULL) - wiped_at) / 60);
+        fflush(stdout);
+        log_wipe_event(job, EVENT_SKIPPED, 0, (unsigned long long)wiped_at);
+        set_wipe_phase(job, PHASE_DONE);
+        return 0;
+    }
+    job->started_ms = monotonic_ms();
+    log_wipe_event(job, EVENT_START, 0, (unsigned long long)checkpoint);
+    #endif
+
+    for (int attempt = 1; attempt <= MAX_RETRIES; attempt++) {
+        if (!device_still_exists(job->device_path)) {
+            #ifndef _WIN32
+            log_wipe_event(job, EVENT_ERROR, ENODEV, 0);
+            #endif
+            set_wipe_phase(job, PHASE_FAILED);
+            report_wipe_result(job, -1);
+            return -1;
+        }
+
+        #ifndef _WIN32
+        if (job->metrics) {
+            atomic_store(&job->metrics->retries, (unsigned)(attempt - 1));
+        }
+        #endif
+
+        set_wipe_phase(job, PHASE_PARTITION_ERASE);
+        #ifndef _WIN32
+        if (job->fast) {
+            int result = destroy_signatures(job);
+            if (result == 0) {
+                set_wipe_phase(job, PHASE_DONE);
+                report_wipe_result(job, 0);
+                return 0;
+            }
+            if (result > 0) {
+                printf("%s: too many signatures to erase one by one, overwriting the whole disk\n",
+                       job->device_path);
+                fflush(stdout);
+                job->fast = 0;
+            }
+        }
+        #endif
+        // fill_with_patterns() marks the fill phase at the start of each pass.
+        if (!job->fast && erase_partition_table(job) == 0) {
+            if (fill_with_patterns(job) == 0) {
+                #ifndef _WIN32
+                clear_checkpoint(job);
+                // A disk with unwritable blocks could not be fingerprinted reliably.
+                if (options.target_count == 0 && job->bad_extents.count == 0) {
+                    record_wiped_device(job);
+                }
+                #endif
+                set_wipe_phase(job, PHASE_DONE);
+                report_wipe_result(job, 0);
+                return 0;
+            }
+        }
+
+        #ifndef _WIN32
+        int error = errno;
+        if (wipe_cancelled(job)) {
+            set_wipe_phase(job, PHASE_CANCELLED);
+            report_wipe_result(job, -1);
+            return -1;
+        }
+        log_wipe_event(job, EVENT_ERROR, error, (unsigned long long)job->resume_offset);
+        // Rewriting a drive that already ignored a rewrite will not help.
+        if (job->verify_failed) {
+            break;
+        }
+        #endif
+
+        if (attempt < MAX_RETRIES) {
+            #ifdef _WIN32
+            Sleep(2000);
+            #else
+            sleep(2);
+            #endif
+        }
+    }
+    set_wipe_phase(job, PHASE_FAILED);
+    report_wipe_result(job, -1);
+    return -1;
+}
+
+void report_wipe_result(struct wipe_job* job, int result) {
+    #ifndef _WIN32
+    printf("%s: wipe %s, %zu unwritable extent(s)", job->device_path,
+           result == 0 ? "complete" : wipe_cancelled(job) ? "cancelled" : "failed", job->bad_extents.count);
+    if (job->io_size) {
+        printf(", %zu KiB writes", job->io_size / 1024);
+    }
+    unsigned long long flush_ns = atomic_load(&job->flush_ns);
+    if (flush_ns) {
+        printf(", %.2f s flushing", flush_ns / 1e9);
+    }
+    if (job->engines_used) {
+        char engines[64];
+        format_engines(job->engines_used, engines, sizeof(engines));
+        printf(", %s engine", engines);
+    }
+    printf("\n");
+    for (size_t i = 0; i < job->bad_extents.count; i++) {
+        struct extent* extent = &job->bad_extents.extents[i];
+        printf("%s: bad extent %lld-%lld (%lld bytes)\n", job->device_path,
+               (long long)extent->start, (long long)extent->end, (long long)(extent->end - extent->start));
+    }
+    for (size_t i = 0; i < job->mismatched_extents.count; i++) {
+        struct extent* extent = &job->mismatched_extents.extents[i];
+        printf("%s: verify mismatch %lld-%lld (%lld bytes)\n", job->device_path,
+               (long long)extent->start, (long long)extent->end, (long long)(extent->end - extent->start));
+    }
+    log_wipe_event(job, EVENT_RESULT,
+                   result == 0 ? PHASE_DONE : wipe_cancelled(job) ? PHASE_CANCELLED : PHASE_FAILED, 0);
+    #else
+    printf("%s: wipe %s\n", job->device_path, result == 0 ? "complete" : "failed");
+    #endif
+    fflush(stdout);
+}
+
+int erase_partition_table(struct wipe_job* job) {
+    #ifdef _WIN32
+    HANDLE hDevice = CreateFileA(job->device_path, GENERIC_WRITE,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+
+    char* zero_buffer = (char*)malloc(FILL_BUFFER_SIZE);
+    if (!zero_buffer) {
+        CloseHandle(hDevice);
+        return -1;
+    }
+    memset(zero_buffer, 0, FILL_BUFFER_SIZE);
+
+    DWORD bytesWritten;
+
+    if (!WriteFile(hDevice, zero_buffer, FILL_BUFFER_SIZE, &bytesWritten, NULL) ||
+        bytesWritten != FILL_BUFFER_SIZE) {
+        free(zero_buffer);
+    CloseHandle(hDevice);
+    return -1;
+        }
+
+        unsigned long long disk_size = 0;
+        if (!get_disk_size_win(hDevice, &disk_size)) {
+            free(zero_buffer);
+            CloseHandle(hDevice);
+            return -1;
+        }
+
+        if (disk_size > FILL_BUFFER_SIZE) {
+            LARGE_INTEGER pos;
+            pos.QuadPart = disk_size - FILL_BUFFER_SIZE;
+            SetFilePointerEx(hDevice, pos, NULL, FILE_BEGIN);
+
+            if (!WriteFile(hDevice, zero_buffer, FILL_BUFFER_SIZE, &bytesWritten, NULL) ||
+                bytesWritten != FILL_BUFFER_SIZE) {
+                free(zero_buffer);
+            CloseHandle(hDevice);
+            return -1;
+                }
+        }
+
+        free(zero_buffer);
+        CloseHandle(hDevice);
+
+    #else
+    struct wipe_target target;
+    if (open_wipe_target(job, &target) != 0) {
+        return -1;
+    }
+
+    char* zero_buffer = shared_zero_region();
+    if (!zero_buffer) {
+        close_wipe_target(&target);
+        return -1;
+    }
+
+    off_t head_end = target.size < FILL_BUFFER_SIZE ? target.size : FILL_BUFFER_SIZE;
+    int result = fill_target_range(&target, zero_buffer, FILL_BUFFER_SIZE, 0, head_end, IO_ENGINE_WRITE);
+
+    if (result == 0 && target.size > FILL_BUFFER_SIZE) {
+        result = fill_target_range(&target, zero_buffer, FILL_BUFFER_SIZE,
+                                   target.size - FILL_BUFFER_SIZE, target.size, IO_ENGINE_WRITE);
+    }
+
+    close_wipe_target(&target);
+    return result;
+    #endif
+    return 0;
+}
+
+#ifndef _WIN32
+unsigned long long read_le(const unsigned char* bytes, int count) {
+    unsigned long long value = 0;
+    for (int i = count - 1; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+unsigned long long read_be(const unsigned char* bytes, int count) {
+    unsigned long long value = 0;
+    for (int i = 0; i < count; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+// Reads the 4 KiB-aligned window around [offset, offset + length) so the
+// probe works on an O_DIRECT descriptor, and returns a pointer to offset.
+const unsigned char* read_probe(struct signature_scan* scan, off_t offset, size_t length) {
+    if (offset < 0 || offset + (off_t)length > scan->size) {
+        return NULL;
+    }
+    off_t window_start = offset / 4096 * 4096;
+    off_t window_end = (offset + (off_t)length + 4095) / 4096 * 4096;
+    if (window_end - window_start > SIGNATURE_PROBE_SIZE) {
+        return NULL;
+    }
+
+    size_t window = (size_t)(window_end - window_start);
+    ssize_t bytes_read;
+    do {
+        bytes_read = device_pread(scan->fd, scan->buffer, window, window_start);
+    } while (bytes_read == -1 && errno == EINTR);
+    if (bytes_read < (ssize_t)(offset - window_start + (off_t)length)) {
+        return NULL;
+    }
+    return (const unsigned char*)scan->buffer + (offset - window_start);
+}
+
+void mark_signature(struct signature_scan* scan, const char* name, off_t start, off_t length) {
+    off_t end = (start + length + 4095) / 4096 * 4096;
+    start = start / 4096 * 4096;
+    if (end > scan->size) {
+        end = scan->size;
+    }
+    if (start >= end) {
+        return;
+    }
+    if (name) {
+        printf("%s: %s signature at %lld\n", scan->job->device_path, name, (long long)start);
+    }
+    if (add_extent(&scan->erase, start, end) != 0) {
+        scan->failed = 1;
+    }
+}
+
+// GPT partitions, or MBR primaries plus the logical partitions chained
+// from an extended one.
+int collect_partitions(struct signature_scan* scan, off_t* starts, off_t* lengths, int max_count) {
+    int count = 0;
+    off_t sectors[2] = { 512, 4096 };
+
+    for (int i = 0; i < 2; i++) {
+        off_t sector = sectors[i];
+        const unsigned char* header = read_probe(scan, sector, 92);
+        if (!header || memcmp(header, "EFI PART", 8) != 0) {
+            continue;
+        }
+        mark_signature(scan, "GPT", sector, sector);
+        mark_signature(scan, "GPT backup", (off_t)read_le(header + 32, 8) * sector, sector);
+
+        off_t entries = (off_t)read_le(header + 72, 8) * sector;
+        unsigned entry_count = (unsigned)read_le(header + 80, 4);
+        unsigned entry_size = (unsigned)read_le(header + 84, 4);
+        if (entry_size < 128 || entry_size > 4096) {
+            return 0;
+        }
+        for (unsigned e = 0; e < entry_count && count < max_count; e++) {
+            const unsigned char* entry = read_probe(scan, entries + (off_t)e * entry_size, entry_size);
+            static const unsigned char unused[16] = {0};
+            if (!entry || memcmp(entry, unused, 16) == 0) {
+                continue;
+            }
+            off_t first = (off_t)read_le(entry + 32, 8);
+            off_t last = (off_t)read_le(entry + 40, 8);
+            if (last >= first) {
+                starts[count] = first * sector;
+                lengths[count] = (last - first + 1) * sector;
+                count++;
+            }
+        }
+        return count;
+    }
+
+    const unsigned char* mbr = read_probe(scan, 0, 512);
+    if (!mbr || mbr[510] != 0x55 || mbr[511] != 0xaa) {
+        return 0;
+    }
+    mark_signature(scan, "MBR", 0, 512);
+
+    unsigned char table[64];
+    memcpy(table, mbr + 446, sizeof(table));
+    for (int i = 0; i < 4 && count < max_count; i++) {
+        const unsigned char* entry = table + i * 16;
+        unsigned char type = entry[4];
+        off_t first = (off_t)read_le(entry + 8, 4);
+        off_t sectors_used = (off_t)read_le(entry + 12, 4);
+        if (type == 0 || sectors_used == 0) {
+            continue;
+        }
+        if (type != 0x05 && type != 0x0f && type != 0x85) {
+            starts[count] = first * 512;
+            lengths[count] = sectors_used * 512;
+            count++;
+            continue;
+        }
+
+        off_t ebr = first;
+        for (int hops = 0; hops < max_count && count < max_count; hops++) {
+            const unsigned char* boot = read_probe(scan, ebr * 512, 512);
+            if (!boot || boot[510] != 0x55 || boot[511] != 0xaa) {
+                break;
+            }
+            mark_signature(scan, "EBR", ebr * 512, 512);
+            off_t logical = (off_t)read_le(boot + 446 + 8, 4);
+            off_t logical_sectors = (off_t)read_le(boot + 446 + 12, 4);
+            off_t next = (off_t)read_le(boot + 462 + 8, 4);
+            if (logical_sectors > 0) {
+                starts[count] = (ebr + logical) * 512;
+                lengths[count] = logical_sectors * 512;
+                count++;
+            }
+            if (next == 0) {
+                break;
+            }
+            ebr = first + next;
+        }
+    }
+    return count;
+}
+
+// Backup superblocks sit at the start of groups 1 and powers of 3, 5 and
+// 7. The primary may already be gone, so every common geometry is probed.
+void probe_ext(struct signature_scan* scan, off_t base, off_t length) {
+    off_t block_sizes[4] = { 1024, 2048, 4096, 0 };
+    off_t group_blocks[4] = { 8192, 16384, 32768, 0 };
+
+    const unsigned char* primary = read_probe(scan, base + 1024, 1024);
+    if (primary && read_le(primary + 56, 2) == 0xef53) {
+        mark_signature(scan, "ext2/3/4", base + 1024, 1024);
+        // s_log_block_size is at most 6 (64 KiB); anything else is damage.
+        unsigned long long log_block_size = read_le(primary + 24, 4);
+        if (log_block_size <= 6) {
+            block_sizes[3] = (off_t)1024 << log_block_size;
+            group_blocks[3] = (off_t)read_le(primary + 32, 4);
+        }
+    }
+
+    for (int geometry = 0; geometry < 4; geometry++) {
+        off_t block_size = block_sizes[geometry];
+        off_t group_size = block_size * group_blocks[geometry];
+        if (group_size <= 0 || block_size > 65536 ||
+            (geometry == 3 && group_blocks[3] == block_size * 8 && block_size <= 4096)) {
+            continue;
+        }
+        off_t groups = length / group_size;
+        unsigned long long powers[3] = { 3, 5, 7 };
+        off_t group = 1;
+        while (group > 0 && group < groups) {
+            off_t offset = base + group * group_size + (block_size == 1024 ? 1024 : 0);
+            const unsigned char* backup = read_probe(scan, offset, 1024);
+            if (backup && read_le(backup + 56, 2) == 0xef53) {
+                mark_signature(scan, "ext2/3/4 backup", offset, 1024);
+            }
+
+            off_t next = 0;
+            for (int i = 0; i < 3; i++) {
+                if (powers[i] < (unsigned long long)groups && (next == 0 || (off_t)powers[i] < next)) {
+                    next = (off_t)powers[i];
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                if ((off_t)powers[i] == next) {
+                    powers[i] *= (unsigned long long)(3 + 2 * i);
+                }
+            }
+            group = next;
+        }
+    }
+}
+
+void probe_xfs(struct signature_scan* scan, off_t base, off_t length) {
+    const unsigned char* sb = read_probe(scan, base, 512);
+    if (!sb || memcmp(sb, "XFSB", 4) != 0) {
+        return;
+    }
+    off_t block_size = (off_t)read_be(sb + 4, 4);
+    off_t ag_blocks = (off_t)read_be(sb + 84, 4);
+    unsigned ag_count = (unsigned)read_be(sb + 88, 4);
+    off_t sector_size = (off_t)read_be(sb + 102, 2);
+
+    // The geometry comes off the disk; without a sane one only the primary
+    // superblock's sector is known.
+    if (block_size < 512 || block_size > 65536 || (block_size & (block_size - 1)) != 0 ||
+        sector_size < 512 || sector_size > block_size || (sector_size & (sector_size - 1)) != 0 ||
+        ag_blocks <= 0) {
+        mark_signature(scan, "XFS", base, 512);
+        return;
+    }
+    mark_signature(scan, "XFS", base, 4 * sector_size);
+
+    off_t ag_size = ag_blocks * block_size;
+    if ((unsigned long long)ag_count > (unsigned long long)((length + ag_size - 1) / ag_size)) {
+        ag_count = (unsigned)((length + ag_size - 1) / ag_size);
+    }
+
+    // Every allocation group starts with a superblock copy, AGF, AGI and AGFL.
+    for (unsigned ag = 1; ag < ag_count; ag++) {
+        off_t offset = (off_t)ag * ag_size;
+        if (offset >= length) {
+            break;
+        }
+        mark_signature(scan, NULL, base + offset, 4 * sector_size);
+    }
+}
+
+void probe_btrfs(struct signature_scan* scan, off_t base, off_t length) {
+    off_t mirrors[3] = { 64 * 1024, 64LL * 1024 * 1024, 256LL * 1024 * 1024 * 1024 };
+    for (int i = 0; i < 3; i++) {
+        if (mirrors[i] + 4096 > length) {
+            break;
+        }
+        const unsigned char* sb = read_probe(scan, base + mirrors[i], 4096);
+        if (sb && memcmp(sb + 64, "_BHRfS_M", 8) == 0) {
+            mark_signature(scan, "btrfs", base + mirrors[i], 4096);
+        }
+    }
+}
+
+// The boot sector alone can be rebuilt from its backup and $MFTMirr, so
+// the first MFT records and their mirror go too.
+void probe_ntfs(struct signature_scan* scan, off_t base, off_t length) {
+    const unsigned char* boot = read_probe(scan, base, 512);
+    if (!boot || memcmp(boot + 3, "NTFS    ", 8) != 0) {
+        return;
+    }
+    mark_signature(scan, "NTFS", base, 512);
+    mark_signature(scan, "NTFS backup", base + length - 512, 512);
+
+    // Every field comes off the disk, so shift counts and sizes are bounded
+    // before use: clusters of at most 2 MiB, MFT records of at most 64 KiB.
+    off_t sector_size = (off_t)read_le(boot + 11, 2);
+    unsigned char per_cluster = boot[13];
+    signed char per_record = (signed char)boot[64];
+    if (sector_size < 256 || sector_size > 4096 || (sector_size & (sector_size - 1)) != 0 ||
+        per_cluster == 0 || (per_cluster > 0x80 && 256 - per_cluster > 21) ||
+        per_record == 0 || per_record < -16) {
+        return;
+    }
+    off_t cluster = per_cluster > 0x80 ? (off_t)1 << (256 - per_cluster) : sector_size * per_cluster;
+    off_t record = per_record > 0 ? per_record * cluster : (off_t)1 << -per_record;
+    if (cluster > 2 * 1024 * 1024 || record > 65536) {
+        return;
+    }
+
+    unsigned long long clusters = (unsigned long long)(length / cluster);
+    unsigned long long mft = read_le(boot + 48, 8);
+    unsigned long long mirror = read_le(boot + 56, 8);
+    if (mft < clusters) {
+        mark_signature(scan, "NTFS $MFT", base + (off_t)mft * cluster, 16 * record);
+    }
+    if (mirror < clusters) {
+        mark_signature(scan, "NTFS $MFTMirr", base + (off_t)mirror * cluster, 4 * record);
+    }
+}
+
+// Both LUKS versions keep the wrapped volume key in keyslots past the
+// header; erase up to where the data segment starts.
+void probe_luks(struct signature_scan* scan, off_t base, off_t length) {
+    const unsigned char* header = read_probe(scan, base, 4096);
+    if (!header || memcmp(header, "LUKS\xba\xbe", 6) != 0) {
+        return;
+    }
+
+    off_t metadata = 16LL * 1024 * 1024;
+    if (read_be(header + 6, 2) == 1) {
+        metadata = (off_t)read_be(header + 104, 4) * 512;
+    } else {
+        off_t header_size = (off_t)read_be(header + 8, 8);
+        const unsigned char* json = read_probe(scan, base + 4096, SIGNATURE_PROBE_SIZE - 4096);
+        if (json && header_size > 4096 && header_size <= SIGNATURE_PROBE_SIZE) {
+            char text[SIGNATURE_PROBE_SIZE];
+            size_t text_length = (size_t)(header_size - 4096);
+            memcpy(text, json, text_length);
+            text[text_length - 1] = '\0';
+            const char* keyslots = strstr(text, "\"keyslots_size\":\"");
+            if (keyslots) {
+                metadata = 2 * header_size + (off_t)strtoull(keyslots + 17, NULL, 10);
+            }
+        }
+    }
+    if (metadata > length) {
+        metadata = length;
+    }
+    mark_signature(scan, "LUKS", base, metadata);
+}
+
+void probe_lvm(struct signature_scan* scan, off_t base, off_t length) {
+    for (off_t sector = 0; sector < 4; sector++) {
+        const unsigned char* label = read_probe(scan, base + sector * 512, 512);
+        if (!label || memcmp(label, "LABELONE", 8) != 0 || memcmp(label + 24, "LVM2 001", 8) != 0) {
+            continue;
+        }
+        mark_signature(scan, "LVM2 PV", base + sector * 512, 512);
+
+        // The PV header lists the data areas, then the metadata areas, each
+        // as a zero-terminated array of (offset, size) pairs.
+        unsigned char pv[512];
+        off_t header = (off_t)read_le(label + 20, 4);
+        if (header < 32 || header > 512 - 40) {
+            return;
+        }
+        memcpy(pv, label, sizeof(pv));
+        const unsigned char* location = pv + header + 40;
+        int list = 0;
+        while (location + 16 <= pv + sizeof(pv) && list < 2) {
+            off_t offset = (off_t)read_le(location, 8);
+            off_t size = (off_t)read_le(location + 8, 8);
+            location += 16;
+            if (offset == 0) {
+                list++;
+                continue;
+            }
+            if (list == 1 && offset < length) {
+                mark_signature(scan, "LVM2 metadata", base + offset, size > 0 ? size : 4096);
+            }
+        }
+        return;
+    }
+}
+
+void probe_md(struct signature_scan* scan, off_t base, off_t length) {
+    off_t candidates[4] = {
+        0,
+        4096,
+        ((length / 512 - 16) & ~(off_t)7) * 512,
+        (length & ~(off_t)65535) - 65536
+    };
+    for (int i = 0; i < 4; i++) {
+        const unsigned char* sb = read_probe(scan, base + candidates[i], 4);
+        if (candidates[i] >= 0 && sb && read_le(sb, 4) == 0xa92b4efc) {
+            mark_signature(scan, "mdraid", base + candidates[i], 4096);
+        }
+    }
+}
+
+// Zeroes the first and last MiB of the region, which covers boot sectors,
+// FAT, LVM labels, md 0.90/1.x, GPT and ZFS labels, and probes for the
+// metadata other formats keep further in.
+void scan_region(struct signature_scan* scan, off_t base, off_t length) {
+    off_t edge = length < SIGNATURE_EDGE_SIZE ? length : SIGNATURE_EDGE_SIZE;
+    probe_ext(scan, base, length);
+    probe_xfs(scan, base, length);
+    probe_btrfs(scan, base, length);
+    probe_ntfs(scan, base, length);
+    probe_luks(scan, base, length);
+    probe_lvm(scan, base, length);
+    probe_md(scan, base, length);
+    mark_signature(scan, NULL, base, edge);
+    mark_signature(scan, NULL, base + length - edge, edge);
+}
+
+// Everything is read before anything is written, since zeroing the
+// partition table first would hide the partitions to scan. Returns 1 when
+// there are more signatures than an extent map holds, for a full wipe.
+int destroy_signatures(struct wipe_job* job) {
+    struct signature_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.job = job;
+    scan.fd = open_verify_fd(job->device_path);
+    if (scan.fd == -1) {
+        return -1;
+    }
+    scan.size = lseek(scan.fd, 0, SEEK_END);
+    scan.buffer = alloc_io_buffer(SIGNATURE_PROBE_SIZE, 4096);
+    if (scan.size <= 0 || !scan.buffer) {
+        free(scan.buffer);
+        device_close(scan.fd);
+        return -1;
+    }
+
+    off_t starts[MAX_SCANNED_PARTITIONS];
+    off_t lengths[MAX_SCANNED_PARTITIONS];
+    int partitions = collect_partitions(&scan, starts, lengths, MAX_SCANNED_PARTITIONS);
+    scan_region(&scan, 0, scan.size);
+    for (int i = 0; i < partitions; i++) {
+        if (starts[i] > 0 && starts[i] + lengths[i] <= scan.size) {
+            scan_region(&scan, starts[i], lengths[i]);
+        }
+    }
+    free(scan.buffer);
+    device_close(scan.fd);
+    if (scan.failed) {
+        free(scan.erase.extents);
+        return 1;
+    }
+
+    struct wipe_target target;
+    char* zero_buffer = NULL;
+    int result = open_wipe_target(job, &target);
+    if (result == 0) {
+        zero_buffer = shared_zero_region();
+        result = zero_buffer ? 0 : -1;
+        for (size_t i = 0; result == 0 && i < scan.erase.count; i++) {
+            result = fill_target_range(&target, zero_buffer, FILL_BUFFER_SIZE, scan.erase.extents[i].start,
+                                       scan.erase.extents[i].end, IO_ENGINE_WRITE);
+        }
+        if (result == 0 && device_flush(target.fd) != 0) {
+            result = -1;
+        }
+        #ifndef __APPLE__
+        if (result == 0) {
+            ioctl(target.fd, BLKRRPART);
+        }
+        #endif
+        close_wipe_target(&target);
+    }
+    free(scan.erase.extents);
+    return result;
+}
+#endif
+
+int fill_with_patterns(struct wipe_job* job) {
+    #ifdef _WIN32
+    HANDLE hDevice = CreateFileA(job->device_path, GENERIC_WRITE,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+
+    unsigned long long disk_size = 0;
+    if (!get_disk_size_win(hDevice, &disk_size)) {
+        CloseHandle(hDevice);
+        return -1;
+    }
+
+    char* zero_buffer = (char*)malloc(FILL_BUFFER_SIZE);
+    if (!zero_buffer) {
+        CloseHandle(hDevice);
+        return -1;
+    }
+    memset(zero_buffer, 0, FILL_BUFFER_SIZE);
+
+    DWORD bytesWritten;
+    unsigned long long totalWritten = 0;
+
+    while (totalWritten < disk_size) {
+        DWORD toWrite = FILL_BUFFER_SIZE;
+        if (totalWritten + toWrite > disk_size) {
+            toWrite = (DWORD)(disk_size - totalWritten);
+        }
+
+        if (!WriteFile(hDevice, zero_buffer, toWrite, &bytesWritten, NULL) ||
+            bytesWritten != toWrite) {
+            free(zero_buffer);
+        CloseHandle(hDevice);
+        return -1;
+            }
+
+            totalWritten += bytesWritten;
+    }
+
+    free(zero_buffer);
+    CloseHandle(hDevice);
+
+    #else
+    struct wipe_target target;
+    if (open_wipe_target(job, &target) != 0) {
+        return -1;
+    }
+
+    size_t candidates[MAX_IO_SIZE_CANDIDATES];
+    int candidate_count = io_size_candidates(&target, candidates, MAX_IO_SIZE_CANDIDATES);
+    if (job->io_size == 0) {
+        job->io_size = options.io_size;
+    }
+    // Zero passes write straight from the shared zero region; only a
+    // fixed-byte pass needs a buffer of its own.
+    size_t buffer_size = job->io_size ? job->io_size : candidates[candidate_count - 1];
+    char* zeros = shared_zero_region();
+    char* byte_buffer = NULL;
+    if (!zeros) {
+        close_wipe_target(&target);
+        return -1;
+    }
+
+    if (job->pass >= options.pass_count) {
+        job->pass = 0;
+    }
+    target.track_progress = 1;
+    atomic_fetch_add(&active_writers, 1);
+    int result = 0;
+
+    while (result == 0) {
+        const struct wipe_pass* pass = &options.passes[job->pass];
+        int last_pass = job->pass + 1 == options.pass_count;
+        off_t start = job->resume_offset < target.size ? job->resume_offset : 0;
+
+        target.pass = pass;
+        target.seed = pattern_seed(job, job->pass);
+        char* buffer = zeros;
+        if (pass->kind == PATTERN_BYTE) {
+            if (!byte_buffer && !(byte_buffer = alloc_io_buffer(buffer_size, target.alignment))) {
+                result = -1;
+                break;
+            }
+            memset(byte_buffer, pass->byte, buffer_size);
+            buffer = byte_buffer;
+        }
+        set_wipe_phase(job, PHASE_FILL);
+
+        struct verifier verifier;
+        int verify = options.verify && last_pass;
+        if (verify && start_verifier(&target, &verifier, start) != 0) {
+            result = -1;
+            break;
+        }
+
+        size_t probe_size = job->io_size ? job->io_size : FILL_BUFFER_SIZE;
+        if (select_io_engine(&target, buffer, probe_size < buffer_size ? probe_size : buffer_size, &start) != 0) {
+            result = -1;
+        }
+        // Under a rate cap every size measures the same, so keep the default.
+        // Files skip it too, since it would write over their holes.
+        if (result == 0 && job->io_size == 0 && !target.regular_file && !offload_expected(&target, pass) && !rate_limited()) {
+            result = calibrate_io_size(&target, buffer, candidates, candidate_count, &start);
+        }
+        size_t io_size = job->io_size ? job->io_size : FILL_BUFFER_SIZE;
+        if (io_size > buffer_size) {
+            io_size = buffer_size;
+        }
+
+        if (result == 0 && target.regular_file) {
+            result = fill_file_extents(&target, buffer, io_size, start);
+        #ifdef __APPLE__
+        } else if (result == 0) {
+            result = fill_partitioned_range(&target, buffer, io_size, start, target.size);
+        }
+        #else
+        } else if (result == 0 && pass->kind == PATTERN_ZERO) {
+            result = fill_with_offload(&target, buffer, io_size, start);
+        } else if (result == 0) {
+            result = fill_partitioned_range(&target, buffer, io_size, start, target.size);
+        }
+        #endif
+        // A pass is only done once it is on stable media; O_DIRECT writes
+        // can still be sitting in the drive's cache.
+        if (result == 0 && flush_target(&target) != 0) {
+            result = -1;
+        }
+        #ifndef __APPLE__
+        if (result == 0 && !target.direct) {
+            posix_fadvise(target.fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        #endif
+
+        if (verify) {
+            result = finish_verifier(&target, &verifier, result);
+        }
+        if (result != 0 || last_pass) {
+            break;
+        }
+
+        // The next pass starts over; journal that so a restart does too.
+        job->pass++;
+        job->resume_offset = 0;
+        job->verified_offset = 0;
+        if (save_checkpoint(job, 0) == 0) {
+            job->checkpoint_offset = 0;
+        }
+    }
+
+    atomic_fetch_sub(&active_writers, 1);
+    free(byte_buffer);
+    close_wipe_target(&target);
+    return result;
+    #endif
+    return 0;
+}
+
+#ifndef _WIN32
+const struct device_backend block_backend = {
+    "block", block_open, close, pwrite, pwritev, pread, block_flush, block_geometry, block_exists
+};
+
+const struct device_backend simulated_backend = {
+    "simulated", simulated_open, simulated_close, simulated_pwrite, simulated_pwritev, simulated_pread,
+    block_flush, simulated_geometry, simulated_exists
+};
+
+// Descriptors the block backend did not open have no entry, which keeps
+// plain files such as the journal and benchmark images on the real calls.
+const struct device_backend* device_backends[MAX_BACKEND_FDS];
+struct simulation simulation;
+struct simulated_device simulated_devices[MAX_TARGETS];
+unsigned simulated_device_count;
+struct simulated_device* simulated_fds[MAX_BACKEND_FDS];
+pthread_mutex_t simulated_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const struct device_backend* backend_for_path(const char* path) {
+    struct stat st;
+    if (options.simulate && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        return &simulated_backend;
+    }
+    return &block_backend;
+}
+
+const struct device_backend* fd_backend(int fd) {
+    const struct device_backend* backend = fd >= 0 && fd < MAX_BACKEND_FDS ? device_backends[fd] : NULL;
+    return backend ? backend : &block_backend;
+}
+
+int device_open(const char* path, int flags) {
+    const struct device_backend* backend = backend_for_path(path);
+    int fd = backend->open(path, flags);
+    if (fd >= 0 && fd < MAX_BACKEND_FDS) {
+        device_backends[fd] = backend;
+    }
+    return fd;
+}
+
+int device_close(int fd) {
+    const struct device_backend* backend = fd_backend(fd);
+    if (fd >= 0 && fd < MAX_BACKEND_FDS) {
+        device_backends[fd] = NULL;
+    }
+    return backend->close(fd);
+}
+
+ssize_t device_pwrite(int fd, const void* buffer, size_t length, off_t offset) {
+    return fd_backend(fd)->pwrite(fd, buffer, length, offset);
+}
+
+ssize_t device_pwritev(int fd, const struct iovec* iovecs, int count, off_t offset) {
+    return fd_backend(fd)->pwritev(fd, iovecs, count, offset);
+}
+
+ssize_t device_pread(int fd, void* buffer, size_t length, off_t offset) {
+    return fd_backend(fd)->pread(fd, buffer, length, offset);
+}
+
+int device_flush(int fd) {
+    return fd_backend(fd)->flush(fd);
+}
+
+int block_open(const char* path, int flags) {
+    return open(path, flags);
+}
+
+// macOS has no fdatasync, and its fsync leaves data in the drive cache;
+// F_FULLFSYNC asks the drive to flush too.
+int block_flush(int fd) {
+    #ifdef __APPLE__
+    if (fcntl(fd, F_FULLFSYNC) == 0) {
+        return 0;
+    }
+    return fsync(fd);
+    #else
+    return fdatasync(fd);
+    #endif
+}
+
+int block_geometry(int fd, off_t* size, unsigned* logical, unsigned* physical) {
+    #ifndef __APPLE__
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        int logical_size = 0;
+        unsigned int physical_size = 0;
+        if (ioctl(fd, BLKSSZGET, &logical_size) == 0 && logical_size > 0) {
+            *logical = (unsigned)logical_size;
+        }
+        if (ioctl(fd, BLKPBSZGET, &physical_size) == 0 && physical_size > 0) {
+            *physical = physical_size;
+        }
+    }
+    #endif
+    *size = lseek(fd, 0, SEEK_END);
+    return *size == -1 ? -1 : 0;
+}
+
+int block_exists(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+// SPEC is a comma-separated list of latency-us=N, mbps=N, block=N,
+// remove-after-mb=N and fail=OFFSET+LENGTH, the last repeatable.
+int parse_simulation(const char* spec) {
+    memset(&simulation, 0, sizeof(simulation));
+    simulation.block_size = 512;
+    if (strcmp(spec, "none") == 0) {
+        return 0;
+    }
+    while (*spec) {
+        size_t length = strcspn(spec, ",");
+        char item[128];
+        if (length == 0 || length >= sizeof(item)) {
+            return -1;
+        }
+        memcpy(item, spec, length);
+        item[length] = '\0';
+        spec += length;
+        if (*spec == ',') {
+            spec++;
+        }
+
+        char* value = strchr(item, '=');
+        if (!value) {
+            return -1;
+        }
+        *value++ = '\0';
+        char* end = NULL;
+        unsigned long long number = strtoull(value, &end, 10);
+        if (end == value) {
+            return -1;
+        }
+
+        if (strcmp(item, "latency-us") == 0 && *end == '\0') {
+            simulation.latency_ns = (long long)number * 1000;
+        } else if (strcmp(item, "mbps") == 0 && *end == '\0') {
+            simulation.rate = number * 1000000;
+        } else if (strcmp(item, "block") == 0 && *end == '\0' && number >= 512 && (number & (number - 1)) == 0) {
+            simulation.block_size = (unsigned)number;
+        } else if (strcmp(item, "remove-after-mb") == 0 && *end == '\0') {
+            simulation.remove_after = number * 1024 * 1024;
+        } else if (strcmp(item, "fail") == 0 && *end == '+' && simulation.failure_count < MAX_SIMULATED_FAILURES) {
+            char* length_end = NULL;
+            unsigned long long failure_length = strtoull(end + 1, &length_end, 10);
+            if (length_end == end + 1 || *length_end != '\0' || failure_length == 0) {
+                return -1;
+            }
+            simulation.failures[simulation.failure_count].start = (off_t)number;
+            simulation.failures[simulation.failure_count].end = (off_t)(number + failure_length);
+            simulation.failure_count++;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct simulated_device* find_simulated_device(const struct stat* st, int create) {
+    struct simulated_device* device = NULL;
+    pthread_mutex_lock(&simulated_lock);
+    for (unsigned i = 0; i < simulated_device_count && !device; i++) {
+        if (simulated_devices[i].dev == st->st_dev && simulated_devices[i].ino == st->st_ino) {
+            device = &simulated_devices[i];
+        }
+    }
+    if (!device && create && simulated_device_count < MAX_TARGETS) {
+        device = &simulated_devices[simulated_device_count++];
+        device->dev = st->st_dev;
+        device->ino = st->st_ino;
+    }
+    pthread_mutex_unlock(&simulated_lock);
+    return device;
+}
+
+// What a disk would do before servicing the request: fail if it is gone,
+// take its time, and report a media error anywhere in a failing range.
+int simulate_io(int fd, off_t offset, size_t length, int write) {
+    struct simulated_device* device = fd >= 0 && fd < MAX_BACKEND_FDS ? simulated_fds[fd] : NULL;
+    if (!device || atomic_load(&device->removed)) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    long long delay = simulation.latency_ns;
+    long long wait = take_tokens(&device->bandwidth, simulation.rate, length);
+    if (wait > 0) {
+        delay += wait;
+    }
+    if (delay > 0) {
+        struct timespec pause = { (time_t)(delay / 1000000000), (long)(delay % 1000000000) };
+        nanosleep(&pause, NULL);
+    }
+
+    if (write) {
+        for (unsigned i = 0; i < simulation.failure_count; i++) {
+            if (simulation.failures[i].start < offset + (off_t)length && simulation.failures[i].end > offset) {
+                errno = EIO;
+                return -1;
+            }
+        }
+        unsigned long long written = atomic_fetch_add(&device->written, length) + length;
+        if (simulation.remove_after && written >= simulation.remove_after) {
+            atomic_store(&device->removed, 1);
+        }
+    }
+    return 0;
+}
+
+// Backing files are opened without O_DIRECT, since the simulated disk is
+// what is being measured rather than the filesystem holding it.
+int simulated_open(const char* path, int flags) {
+    int fd = open(path, flags & ~O_CREAT);
+    struct stat st;
+    if (fd == -1) {
+        return -1;
+    }
+    struct simulated_device* device = fstat(fd, &st) == 0 ? find_simulated_device(&st, 1) : NULL;
+    if (!device || fd >= MAX_BACKEND_FDS || atomic_load(&device->removed)) {
+        close(fd);
+        errno = device ? ENODEV : EMFILE;
+        return -1;
+    }
+    simulated_fds[fd] = device;
+    return fd;
+}
+
+int simulated_close(int fd) {
+    if (fd >= 0 && fd < MAX_BACKEND_FDS) {
+        simulated_fds[fd] = NULL;
+    }
+    return close(fd);
+}
+
+ssize_t simulated_pwrite(int fd, const void* buffer, size_t length, off_t offset) {
+    if (simulate_io(fd, offset, length, 1) != 0) {
+        return -1;
+    }
+    return pwrite(fd, buffer, length, offset);
+}
+
+ssize_t simulated_pwritev(int fd, const struct iovec* iovecs, int count, off_t offset) {
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        length += iovecs[i].iov_len;
+    }
+    if (simulate_io(fd, offset, length, 1) != 0) {
+        return -1;
+    }
+    return pwritev(fd, iovecs, count, offset);
+}
+
+ssize_t simulated_pread(int fd, void* buffer, size_t length, off_t offset) {
+    if (simulate_io(fd, offset, length, 0) != 0) {
+        return -1;
+    }
+    return pread(fd, buffer, length, offset);
+}
+
+int simulated_geometry(int fd, off_t* size, unsigned* logical, unsigned* physical) {
+    *logical = simulation.block_size;
+    *physical = simulation.block_size;
+    *size = lseek(fd, 0, SEEK_END);
+    return *size == -1 ? -1 : 0;
+}
+
+int simulated_exists(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    struct simulated_device* device = find_simulated_device(&st, 0);
+    return !device || !atomic_load(&device->removed);
+}
+
+int open_wipe_target(struct wipe_job* job, struct wipe_target* target) {
+    const char* device_path = job->device_path;
+
+    memset(target, 0, sizeof(*target));
+    target->job = job;
+    target->logical_block_size = 1;
+    target->physical_block_size = 1;
+    target->alignment = (size_t)sysconf(_SC_PAGESIZE);
+
+    int flags = O_WRONLY;
+    struct stat st;
+    int simulated = backend_for_path(device_path) == &simulated_backend;
+    int is_block = stat(device_path, &st) == 0 && S_ISBLK(st.st_mode);
+    target->regular_file = !is_block && !simulated && S_ISREG(st.st_mode);
+    #ifndef __APPLE__
+    if (is_block && options.direct) {
+        flags |= O_DIRECT;
+    }
+    #endif
+
+    // A buffered target is opened for reading as well so the mmap engine can
+    // map it; one the caller may only write is still wiped without mmap.
+    target->fd = -1;
+    #ifndef __APPLE__
+    if (!(flags & O_DIRECT) && !simulated) {
+    #else
+    if (!simulated) {
+    #endif
+        target->fd = device_open(device_path, (flags & ~O_ACCMODE) | O_RDWR);
+        target->mappable = target->fd != -1;
+    }
+    if (target->fd == -1) {
+        target->fd = device_open(device_path, flags);
+    }
+    #ifndef __APPLE__
+    if (target->fd == -1 && (flags & O_DIRECT) && errno == EINVAL) {
+        flags &= ~O_DIRECT;
+        target->fd = device_open(device_path, flags);
+    }
+    target->direct = (flags & O_DIRECT) != 0;
+    #endif
+    if (target->fd == -1) {
+        return -1;
+    }
+
+    if (fd_backend(target->fd)->geometry(target->fd, &target->size, &target->logical_block_size,
+                                         &target->physical_block_size) != 0) {
+        device_close(target->fd);
+        return -1;
+    }
+    if (target->physical_block_size < target->logical_block_size) {
+        target->physical_block_size = target->logical_block_size;
+    }
+    if (target->physical_block_size > target->alignment) {
+        target->alignment = target->physical_block_size;
+    }
+
+    job->size = (unsigned long long)target->size;
+    if (job->metrics) {
+        atomic_store(&job->metrics->total_bytes, job->size);
+    }
+    return 0;
+}
+
+void close_wipe_target(struct wipe_target* target) {
+    if (target->fd != -1) {
+        device_close(target->fd);
+        target->fd = -1;
+    }
+}
+
+char* zero_region = NULL;
+pthread_once_t zero_region_once = PTHREAD_ONCE_INIT;
+
+// One zero region serves every zero write in the process, however many
+// devices are being wiped. It is touched once so the pages are real rather
+// than the kernel zero page, and left writable because io_uring refuses to
+// register read-only memory; nothing ever writes to it.
+void map_zero_region() {
+    void* region = MAP_FAILED;
+    #ifdef MAP_HUGETLB
+    region = mmap(NULL, ZERO_REGION_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    #endif
+    if (region == MAP_FAILED) {
+        region = mmap(NULL, ZERO_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        #ifdef MADV_HUGEPAGE
+        if (region != MAP_FAILED) {
+            madvise(region, ZERO_REGION_SIZE, MADV_HUGEPAGE);
+        }
+        #endif
+    }
+    if (region != MAP_FAILED) {
+        memset(region, 0, ZERO_REGION_SIZE);
+        zero_region = (char*)region;
+    }
+}
+
+char* shared_zero_region() {
+    pthread_once(&zero_region_once, map_zero_region);
+    return zero_region;
+}
+
+char* alloc_io_buffer(size_t size, size_t alignment) {
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, alignment, size) != 0) {
+        return NULL;
+    }
+    memset(buffer, 0, size);
+    return (char*)buffer;
+}
+
+const struct io_engine io_engines[] = {
+    #ifdef __APPLE__
+    { "uring", NULL, NULL },
+    #else
+    { "uring", uring_engine_usable, uring_engine_fill },
+    #endif
+    { "write", write_engine_usable, write_engine_fill },
+    { "mmap", mmap_engine_usable, fill_range_mmap },
+    #ifdef __APPLE__
+    { "splice", NULL, NULL },
+    #else
+    { "splice", splice_engine_usable, fill_range_splice },
+    #endif
+};
+
+const char* engine_name(enum io_engine_kind kind) {
+    return kind < IO_ENGINE_AUTO ? io_engines[kind].name : "auto";
+}
+
+int engine_usable(enum io_engine_kind kind, struct wipe_target* target) {
+    return kind < IO_ENGINE_AUTO && io_engines[kind].usable && io_engines[kind].usable(target);
+}
+
+int uring_engine_usable(struct wipe_target* target) {
+    return fd_backend(target->fd) == &block_backend;
+}
+
+int write_engine_usable(struct wipe_target* target) {
+    (void)target;
+    return 1;
+}
+
+_Thread_local sigjmp_buf* mmap_fault_jump;
+pthread_once_t mmap_fault_once = PTHREAD_ONCE_INIT;
+
+// A mapping goes through the page cache, which O_DIRECT was opened to avoid,
+// and needs the target open for reading too. The SIGBUS handler goes in the
+// first time a target could be mapped and stays for the process.
+int mmap_engine_usable(struct wipe_target* target) {
+    if (!target->mappable || fd_backend(target->fd) != &block_backend) {
+        return 0;
+    }
+    pthread_once(&mmap_fault_once, install_mmap_fault_handler);
+    return 1;
+}
+
+#ifndef __APPLE__
+int splice_works;
+pthread_once_t splice_once = PTHREAD_ONCE_INIT;
+
+int splice_engine_usable(struct wipe_target* target) {
+    if (target->pass && target->pass->kind != PATTERN_ZERO) {
+        return 0;
+    }
+    pthread_once(&splice_once, probe_splice_support);
+    return splice_works && fd_backend(target->fd) == &block_backend;
+}
+
+int uring_engine_fill(struct wipe_target* target, struct pattern_stream* stream) {
+    return fill_range_uring(target, stream, options.queue_depth);
+}
+#endif
+
+int write_engine_fill(struct wipe_target* target, struct pattern_stream* stream) {
+    return stream->pass ? fill_range_write(target, stream) : fill_range_writev(target, stream);
+}
+
+int fill_target_range(struct wipe_target* target, char* buffer, size_t buffer_size,
+                      off_t start, off_t end, enum io_engine_kind engine) {
+    off_t aligned_start = start;
+    off_t aligned_end = end;
+
+    if (target->direct) {
+        off_t block = target->logical_block_size;
+        aligned_start = (start + block - 1) / block * block;
+        aligned_end = end / block * block;
+
+        if (aligned_start >= aligned_end) {
+            return write_unaligned_range(target, buffer, buffer_size, start, end);
+        }
+        if (start < aligned_start &&
+            write_unaligned_range(target, buffer, buffer_size, start, aligned_start) != 0) {
+            return -1;
+        }
+    }
+
+    struct pattern_stream stream;
+    if (open_pattern_stream(&stream, target, buffer, buffer_size, aligned_start, aligned_end) != 0) {
+        return -1;
+    }
+
+    int result = ENGINE_UNAVAILABLE;
+    if (engine_usable(engine, target)) {
+        result = io_engines[engine].fill(target, &stream);
+    }
+    if (result == ENGINE_UNAVAILABLE) {
+        result = write_engine_fill(target, &stream);
+    }
+    close_pattern_stream(&stream);
+
+    if (result == 0 && aligned_end < end) {
+        result = write_unaligned_range(target, buffer, buffer_size, aligned_end, end);
+    }
+    return result;
+}
+
+unsigned claim_range_workers(unsigned wanted) {
+    unsigned busy = atomic_load(&active_writers);
+    unsigned granted;
+    do {
+        granted = busy < options.workers ? options.workers - busy : 0;
+        if (granted > wanted) {
+            granted = wanted;
+        }
+    } while (granted > 0 && !atomic_compare_exchange_weak(&active_writers, &busy, busy + granted));
+    return granted;
+}
+
+// Splits [start, end) into up to options.ranges slices written in parallel,
+// for LUNs that take far more concurrent writes than one thread issues. The
+// calling thread only watches: everything below the first unfinished slice
+// is written, so that is what the checkpoint and the verifier see.
+int fill_partitioned_range(struct wipe_target* target, char* buffer, size_t buffer_size, off_t start, off_t end) {
+    unsigned wanted = options.ranges;
+    if (wanted > MAX_RANGES) {
+        wanted = MAX_RANGES;
+    }
+    if ((off_t)wanted > (end - start) / MIN_RANGE_SIZE) {
+        wanted = (unsigned)((end - start) / MIN_RANGE_SIZE);
+    }
+    // The caller's own slot covers the first range.
+    unsigned extra = wanted > 1 ? claim_range_workers(wanted - 1) : 0;
+    if (extra == 0) {
+        return fill_target_range(target, buffer, buffer_size, start, end, target->job->engine);
+    }
+
+    unsigned count = extra + 1;
+    struct fill_range* ranges = (struct fill_range*)calloc(count, sizeof(*ranges));
+    if (!ranges) {
+        atomic_fetch_sub(&active_writers, extra);
+        return -1;
+    }
+
+    int flags = O_WRONLY;
+    #ifndef __APPLE__
+    if (target->direct) {
+        flags |= O_DIRECT;
+    }
+    #endif
+    off_t unit = (off_t)buffer_size;
+    unsigned started = 0;
+    int result = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct fill_range* range = &ranges[i];
+        off_t range_start = start + (end - start) / count * i / unit * unit;
+        range->end = i + 1 < count ? start + (end - start) / count * (i + 1) / unit * unit : end;
+        range->buffer = buffer;
+        range->buffer_size = buffer_size;
+        range->target = *target;
+        range->target.track_progress = 0;
+        range->target.verifier = NULL;
+        range->target.range_written = &range->written;
+        range->target.bad_extents = &range->bad_extents;
+        range->target.dirty_start = range_start;
+        range->target.writeback_start = range_start;
+        atomic_init(&range->written, (long long)range_start);
+        atomic_init(&range->done, 0);
+
+        // Opened like the parent, so a range can map its fd when the parent could.
+        range->target.fd = -1;
+        if (target->mappable) {
+            range->target.fd = device_open(target->job->device_path, (flags & ~O_ACCMODE) | O_RDWR);
+        }
+        range->target.mappable = range->target.fd != -1;
+        if (range->target.fd == -1) {
+            range->target.fd = device_open(target->job->device_path, flags);
+        }
+        if (range->target.fd == -1 ||
+            pthread_create(&range->thread, NULL, fill_range_thread, range) != 0) {
+            if (range->target.fd != -1) {
+                device_close(range->target.fd);
+            }
+            result = -1;
+            break;
+        }
+        started++;
+    }
+
+    // If a range could not start, the others still run to the end and the
+    // wipe's retry resumes from the last checkpoint.
+    for (unsigned finished = 0; finished < started;) {
+        usleep(RANGE_POLL_MS * 1000);
+        finished = 0;
+        off_t low_water = end;
+        for (unsigned i = 0; i < started; i++) {
+            off_t written = (off_t)atomic_load_explicit(&ranges[i].written, memory_order_acquire);
+            if (written < ranges[i].end && low_water == end) {
+                low_water = written;
+            }
+            finished += atomic_load(&ranges[i].done);
+        }
+        if (result == 0 && finished < started) {
+            record_fill_progress(target, low_water);
+        }
+    }
+
+    for (unsigned i = 0; i < started; i++) {
+        struct fill_range* range = &ranges[i];
+        pthread_join(range->thread, NULL);
+        device_close(range->target.fd);
+        if (range->result != 0) {
+            result = -1;
+        }
+        for (size_t e = 0; e < range->bad_extents.count; e++) {
+            if (add_extent(&target->job->bad_extents, range->bad_extents.extents[e].start,
+                           range->bad_extents.extents[e].end) != 0) {
+                result = -1;
+            }
+        }
+        free(range->bad_extents.extents);
+    }
+    free(ranges);
+    atomic_fetch_sub(&active_writers, extra);
+
+    if (result == 0) {
+        record_fill_progress(target, end);
+    }
+    return result;
+}
+
+// A range that fails is retried from where it got to, without disturbing
+// the others.
+void* fill_range_thread(void* arg) {
+    struct fill_range* range = (struct fill_range*)arg;
+    struct wipe_job* job = range->target.job;
+
+    range->result = -1;
+    for (int attempt = 1; attempt <= MAX_RETRIES && !wipe_cancelled(job); attempt++) {
+        off_t resume = (off_t)atomic_load(&range->written);
+        range->result = fill_target_range(&range->target, range->buffer, range->buffer_size,
+                                          resume, range->end, job->engine);
+        if (range->result == 0 || !device_still_exists(job->device_path)) {
+            break;
+        }
+        if (attempt < MAX_RETRIES) {
+            sleep(1);
+        }
+    }
+    atomic_store(&range->done, 1);
+    return NULL;
+}
+
+// O_DIRECT rejects I/O that is not a multiple of the logical block size, so
+// the rare partial block at either edge goes through the page cache instead.
+int write_unaligned_range(struct wipe_target* target, const char* buffer, size_t buffer_size,
+                          off_t start, off_t end) {
+    char* random = NULL;
+    if (target->pass && target->pass->kind == PATTERN_RANDOM) {
+        buffer_size = (size_t)(end - start);
+        random = (char*)malloc(buffer_size);
+        if (!random) {
+            return -1;
+        }
+        fill_pattern(target->pass, target->seed, start, random, buffer_size);
+        buffer = random;
+    }
+
+    struct pattern_stream stream;
+    constant_pattern_stream(&stream, buffer, buffer_size, start, end);
+    int result = -1;
+
+    if (!target->direct) {
+        result = fill_range_write(target, &stream);
+    } else {
+        #ifndef __APPLE__
+        int flags = fcntl(target->fd, F_GETFL);
+        if (flags != -1 && fcntl(target->fd, F_SETFL, flags & ~O_DIRECT) != -1) {
+            result = fill_range_write(target, &stream);
+            if (result == 0 && fdatasync(target->fd) != 0) {
+                result = -1;
+            }
+            if (fcntl(target->fd, F_SETFL, flags) == -1) {
+                result = -1;
+            }
+        }
+        #endif
+    }
+
+    free(random);
+    return result;
+}
+
+int fill_range_write(struct wipe_target* target, struct pattern_stream* stream) {
+    for (long long sequence = 0;; sequence++) {
+        off_t chunk_start = stream->start + sequence * (off_t)stream->chunk_size;
+        if (chunk_start >= stream->end) {
+            break;
+        }
+        if (wipe_cancelled(target->job)) {
+            return -1;
+        }
+        off_t chunk_end = stream->end - chunk_start > (off_t)stream->chunk_size
+                          ? chunk_start + (off_t)stream->chunk_size : stream->end;
+        off_t offset = chunk_start;
+
+        const char* data = acquire_pattern_chunk(stream, sequence);
+        if (!data) {
+            return -1;
+        }
+
+        throttle_io(target->job, (unsigned long long)(chunk_end - chunk_start));
+        while (offset < chunk_end) {
+            const char* chunk = data + (offset - chunk_start);
+            long long started = write_latency ? monotonic_ns() : 0;
+            ssize_t bytesWritten = device_pwrite(target->fd, chunk, (size_t)(chunk_end - offset), offset);
+            if (bytesWritten == -1 && errno == EINTR) {
+                continue;
+            }
+            record_write_latency(started);
+            if (bytesWritten <= 0) {
+                if (bytesWritten == 0 || !is_media_error(errno) ||
+                    recover_failed_range(target, chunk, offset, chunk_end) != 0) {
+                    release_pattern_chunk(stream, sequence);
+                    return -1;
+                }
+                bytesWritten = (ssize_t)(chunk_end - offset);
+            }
+
+            offset += bytesWritten;
+            add_bytes_written(target->job, (unsigned long long)bytesWritten);
+            record_fill_progress(target, offset);
+        }
+        release_pattern_chunk(stream, sequence);
+    }
+    return 0;
+}
+
+// A constant stream hands every chunk the same buffer, so one pwritev can
+// point up to WRITEV_BATCH_SIZE worth of iovecs at it. A media error
+// replays the batch chunk by chunk so bad extents are still mapped.
+int fill_range_writev(struct wipe_target* target, struct pattern_stream* stream) {
+    struct iovec iovecs[WRITEV_MAX_IOVECS];
+    off_t offset = stream->start;
+
+    while (offset < stream->end) {
+        if (wipe_cancelled(target->job)) {
+            return -1;
+        }
+
+        int count = 0;
+        off_t batch_end = offset;
+        while (count < WRITEV_MAX_IOVECS && batch_end < stream->end && batch_end - offset < WRITEV_BATCH_SIZE) {
+            size_t length = stream->end - batch_end > (off_t)stream->chunk_size
+                            ? stream->chunk_size : (size_t)(stream->end - batch_end);
+            iovecs[count].iov_base = stream->buffer;
+            iovecs[count].iov_len = length;
+            count++;
+            batch_end += (off_t)length;
+        }
+
+        throttle_io(target->job, (unsigned long long)(batch_end - offset));
+        long long started = write_latency ? monotonic_ns() : 0;
+        ssize_t written = device_pwritev(target->fd, iovecs, count, offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (started > 0) {
+            record_write_time(monotonic_ns() - started, (unsigned)count);
+        }
+
+        if (written <= 0) {
+            if (written == 0 || !is_media_error(errno)) {
+                return -1;
+            }
+            struct pattern_stream chunks;
+            constant_pattern_stream(&chunks, stream->buffer, stream->chunk_size, offset, batch_end);
+            if (fill_range_write(target, &chunks) != 0) {
+                return -1;
+            }
+            offset = batch_end;
+            continue;
+        }
+
+        offset += written;
+        add_bytes_written(target->job, (unsigned long long)written);
+        record_fill_progress(target, offset);
+    }
+    return 0;
+}
+
+// Fills through a shared mapping instead of a write() per chunk: the
+// pattern is copied in with non-temporal stores and each MMAP_WINDOW_SIZE
+// window is unmapped once written, leaving writeback to bound_dirty_pages.
+// A chunk whose store faults, on a bad sector or a full file system, is
+// redone with write() so the error is handled as on the other engines.
+// Each stored chunk counts as a write, timed as its share of the window's
+// stores and release.
+int fill_range_mmap(struct wipe_target* target, struct pattern_stream* stream) {
+    off_t page = (off_t)sysconf(_SC_PAGESIZE);
+    off_t map_limit = (stream->end + page - 1) / page * page;
+    char* map = NULL;
+    off_t map_start = 0;
+    size_t map_length = 0;
+    off_t mapped_end = stream->start;
+    long long window_ns = 0;
+    unsigned window_chunks = 0;
+    int result = 0;
+
+    for (long long sequence = 0;; sequence++) {
+        off_t chunk_start = stream->start + sequence * (off_t)stream->chunk_size;
+        if (chunk_start >= stream->end) {
+            break;
+        }
+        if (wipe_cancelled(target->job)) {
+            result = -1;
+            break;
+        }
+        off_t chunk_end = stream->end - chunk_start > (off_t)stream->chunk_size
+                          ? chunk_start + (off_t)stream->chunk_size : stream->end;
+
+        const char* data = acquire_pattern_chunk(stream, sequence);
+        if (!data) {
+            result = -1;
+            break;
+        }
+
+        if (map && chunk_end > map_start + (off_t)map_length) {
+            long long started = write_latency ? monotonic_ns() : 0;
+            release_mmap_window(map, map_length);
+            map = NULL;
+            if (started > 0) {
+                record_write_time(window_ns + monotonic_ns() - started, window_chunks);
+            }
+            record_fill_progress(target, mapped_end);
+        }
+        if (!map) {
+            window_ns = 0;
+            window_chunks = 0;
+            map_start = chunk_start / page * page;
+            map_length = (size_t)(map_limit - map_start < MMAP_WINDOW_SIZE ? map_limit - map_start : MMAP_WINDOW_SIZE);
+            map = (char*)mmap(NULL, map_length, PROT_WRITE, MAP_SHARED, target->fd, map_start);
+            if (map == MAP_FAILED) {
+                map = NULL;
+            }
+        }
+
+        if (map) {
+            throttle_io(target->job, (unsigned long long)(chunk_end - chunk_start));
+        }
+        long long started = map && write_latency ? monotonic_ns() : 0;
+        if (map && store_mapped_chunk(map + (chunk_start - map_start), data, (size_t)(chunk_end - chunk_start)) == 0) {
+            if (started > 0) {
+                window_ns += monotonic_ns() - started;
+            }
+            window_chunks++;
+            add_bytes_written(target->job, (unsigned long long)(chunk_end - chunk_start));
+            mapped_end = chunk_end;
+        } else {
+            if (map) {
+                munmap(map, map_length);
+                map = NULL;
+                record_write_time(window_ns, window_chunks);
+            }
+            struct pattern_stream single;
+            constant_pattern_stream(&single, data, stream->chunk_size, chunk_start, chunk_end);
+            if (fill_range_write(target, &single) != 0) {
+                release_pattern_chunk(stream, sequence);
+                result = -1;
+                break;
+            }
+        }
+        release_pattern_chunk(stream, sequence);
+    }
+
+    if (map) {
+        long long started = write_latency ? monotonic_ns() : 0;
+        release_mmap_window(map, map_length);
+        if (started > 0) {
+            record_write_time(window_ns + monotonic_ns() - started, window_chunks);
+        }
+        if (result == 0) {
+            record_fill_progress(target, mapped_end);
+        }
+    }
+    return result;
+}
+
+// Only a store made by store_mapped_chunk() is recovered from; any other
+// SIGBUS still kills the process.
+void mmap_fault_handler(int signal_number) {
+    if (mmap_fault_jump) {
+        siglongjmp(*mmap_fault_jump, 1);
+    }
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+void install_mmap_fault_handler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = mmap_fault_handler;
+    // The handler jumps out rather than returning, so SIGBUS must not stay blocked.
+    action.sa_flags = SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+int store_mapped_chunk(char* map, const char* data, size_t length) {
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 0) != 0) {
+        mmap_fault_jump = NULL;
+        return -1;
+    }
+    mmap_fault_jump = &jump;
+    store_nontemporal(map, data, length);
+    mmap_fault_jump = NULL;
+    return 0;
+}
+
+void release_mmap_window(char* map, size_t length) {
+    msync(map, length, MS_ASYNC);
+    madvise(map, length, MADV_DONTNEED);
+    munmap(map, length);
+}
+
+#ifndef __APPLE__
+// Zero passes only: the kernel moves /dev/zero pages through a pipe into
+// the target, so no user-space buffer is touched. A failed splice leaves
+// its bytes in the pipe, so after recover_failed_range() has dealt with
+// that piece the pipe is replaced.
+int fill_range_splice(struct wipe_target* target, struct pattern_stream* stream) {
+    int zero_fd = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+    if (zero_fd == -1) {
+        return ENGINE_UNAVAILABLE;
+    }
+    int pipe_fds[2];
+    size_t piece = open_splice_pipe(pipe_fds);
+    if (piece == 0) {
+        close(zero_fd);
+        return ENGINE_UNAVAILABLE;
+    }
+    // Recovery rewrites a failed piece from the stream's zero buffer.
+    if (piece > stream->chunk_size) {
+        piece = stream->chunk_size;
+    }
+
+    off_t offset = stream->start;
+    int result = 0;
+    while (offset < stream->end) {
+        if (wipe_cancelled(target->job)) {
+            result = -1;
+            break;
+        }
+        size_t length = stream->end - offset > (off_t)piece ? piece : (size_t)(stream->end - offset);
+        ssize_t filled = splice(zero_fd, NULL, pipe_fds[1], NULL, length, SPLICE_F_MOVE);
+        if (filled == -1 && errno == EINTR) {
+            continue;
+        }
+        if (filled <= 0) {
+            result = -1;
+            break;
+        }
+
+        throttle_io(target->job, (unsigned long long)filled);
+        long long started = write_latency ? monotonic_ns() : 0;
+        ssize_t written = 0;
+        int error = 0;
+        while (written < filled) {
+            loff_t position = offset + written;
+            ssize_t moved = splice(pipe_fds[0], NULL, target->fd, &position, (size_t)(filled - written), SPLICE_F_MOVE);
+            if (moved == -1 && errno == EINTR) {
+                continue;
+            }
+            if (moved <= 0) {
+                error = moved == 0 ? EIO : errno;
+                break;
+            }
+            written += moved;
+        }
+        record_write_latency(started);
+
+        if (written < filled) {
+            // Some file systems and drivers cannot take a splice at all.
+            if (offset == stream->start && written == 0 && error == EINVAL) {
+                result = ENGINE_UNAVAILABLE;
+                break;
+            }
+            if (!is_media_error(error) ||
+                recover_failed_range(target, stream->buffer, offset + written, offset + filled) != 0) {
+                result = -1;
+                break;
+            }
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            if (open_splice_pipe(pipe_fds) == 0) {
+                close(zero_fd);
+                return -1;
+            }
+        }
+
+        offset += filled;
+        add_bytes_written(target->job, (unsigned long long)filled);
+        record_fill_progress(target, offset);
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(zero_fd);
+    return result;
+}
+
+// Returns the pipe's capacity, or 0 if there is no pipe.
+size_t open_splice_pipe(int fds[2]) {
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return 0;
+    }
+    int size = fcntl(fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (size <= 0) {
+        size = fcntl(fds[1], F_GETPIPE_SZ);
+    }
+    if (size <= 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    return (size_t)size;
+}
+
+// /dev/zero only supports splice on newer kernels.
+void probe_splice_support() {
+    int zero_fd = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+    int fds[2];
+    if (zero_fd == -1) {
+        return;
+    }
+    if (open_splice_pipe(fds) != 0) {
+        splice_works = splice(zero_fd, NULL, fds[1], NULL, 4096, 0) == 4096;
+        close(fds[0]);
+        close(fds[1]);
+    }
+    close(zero_fd);
+}
+#endif
+
+// Only errors a drive returns for sectors it cannot write are narrowed down
+// to bad extents; anything else, such as misaligned I/O or a transport that
+// went away, fails the job instead of being split block by block.
+int is_media_error(int error) {
+    switch (error) {
+        case EIO:
+        case EILSEQ:
+        #ifdef ENODATA
+        case ENODATA:
+        #endif
+        #ifdef EREMOTEIO
+        case EREMOTEIO:
+        #endif
+        #ifdef EBADMSG
+        case EBADMSG:
+        #endif
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int pwrite_all(int fd, const char* buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = device_pwrite(fd, buffer, length, offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            if (written == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        buffer += written;
+        length -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+int add_extent(struct extent_map* map, off_t start, off_t end) {
+    size_t index = map->count;
+    while (index > 0 && map->extents[index - 1].start > start) {
+        index--;
+    }
+
+    if (index > 0 && map->extents[index - 1].end >= start) {
+        index--;
+        if (end > map->extents[index].end) {
+            map->extents[index].end = end;
+        }
+    } else {
+        // A drive that fails everywhere is dead, not dotted with bad sectors.
+        if (map->count >= MAX_EXTENTS) {
+            return -1;
+        }
+        if (map->count == map->capacity) {
+            size_t capacity = map->capacity ? map->capacity * 2 : 16;
+            struct extent* extents = (struct extent*)realloc(map->extents, capacity * sizeof(*extents));
+            if (!extents) {
+                return -1;
+            }
+            map->extents = extents;
+            map->capacity = capacity;
+        }
+
+        memmove(&map->extents[index + 1], &map->extents[index],
+                (map->count - index) * sizeof(struct extent));
+        map->extents[index].start = start;
+        map->extents[index].end = end;
+        map->count++;
+    }
+
+    while (index + 1 < map->count && map->extents[index + 1].start <= map->extents[index].end) {
+        if (map->extents[index + 1].end > map->extents[index].end) {
+            map->extents[index].end = map->extents[index + 1].end;
+        }
+        memmove(&map->extents[index + 1], &map->extents[index + 2],
+                (map->count - index - 2) * sizeof(struct extent));
+        map->count--;
+    }
+    return 0;
+}
+
+// A write of buffer to [start, end) failed with a media error. Split it in
+// halves down to the logical block size, record the blocks that still fail
+// and let the wipe carry on with the rest of the device.
+int recover_failed_range(struct wipe_target* target, const char* buffer, off_t start, off_t end) {
+    off_t block = target->logical_block_size < 512 ? 512 : target->logical_block_size;
+    if (wipe_cancelled(target->job)) {
+        return -1;
+    }
+    if (end - start <= block) {
+        log_wipe_event(target->job, EVENT_ERROR, errno, (unsigned long long)start);
+        return add_extent(target->bad_extents ? target->bad_extents : &target->job->bad_extents, start, end);
+    }
+
+    off_t middle = start + (end - start) / 2 / block * block;
+    if (middle <= start) {
+        middle = start + block;
+    }
+
+    off_t halves[2][2] = { { start, middle }, { middle, end } };
+    for (int i = 0; i < 2; i++) {
+        const char* half = buffer + (halves[i][0] - start);
+        if (pwrite_all(target->fd, half, (size_t)(halves[i][1] - halves[i][0]), halves[i][0]) == 0) {
+            continue;
+        }
+        if (!is_media_error(errno) || recover_failed_range(target, half, halves[i][0], halves[i][1]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int extent_overlaps(const struct extent_map* map, off_t start, off_t end) {
+    for (size_t i = 0; i < map->count; i++) {
+        if (map->extents[i].start < end && map->extents[i].end > start) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int (*zero_check)(const char* data, size_t length) = buffer_is_zero_scalar;
+void (*pattern_generator)(uint64_t state[4][PATTERN_LANES], char* out, size_t length) = xoshiro_fill_scalar;
+void (*stream_store)(char* dst, const char* src, size_t length) = stream_store_scalar;
+pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+int buffer_is_zero_scalar(const char* data, size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        uint64_t words[4];
+        memcpy(words, data + i, sizeof(words));
+        if (words[0] | words[1] | words[2] | words[3]) {
+            return 0;
+        }
+    }
+    for (; i < length; i++) {
+        if (data[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+int buffer_is_zero_sse2(const char* data, size_t length) {
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(data + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(data + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF) {
+            return 0;
+        }
+    }
+    return buffer_is_zero_scalar(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+int buffer_is_zero_avx2(const char* data, size_t length) {
+    size_t i = 0;
+    for (; i + 128 <= length; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(data + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(data + i + 96));
+        __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(any, any)) {
+            return 0;
+        }
+    }
+    return buffer_is_zero_scalar(data + i, length - i);
+}
+#elif defined(__aarch64__)
+int buffer_is_zero_neon(const char* data, size_t length) {
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        const uint8_t* bytes = (const uint8_t*)(data + i);
+        uint8x16_t any = vorrq_u8(vorrq_u8(vld1q_u8(bytes), vld1q_u8(bytes + 16)),
+                                  vorrq_u8(vld1q_u8(bytes + 32), vld1q_u8(bytes + 48)));
+        if (vmaxvq_u8(any) != 0) {
+            return 0;
+        }
+    }
+    return buffer_is_zero_scalar(data + i, length - i);
+}
+#endif
+
+// Copies for the mmap engine. The bytes are on their way to the disk and
+// nothing reads them back soon, so the SIMD versions store around the cache.
+void stream_store_scalar(char* dst, const char* src, size_t length) {
+    memcpy(dst, src, length);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void stream_store_sse2(char* dst, const char* src, size_t length) {
+    size_t i = (size_t)(-(uintptr_t)dst & 15);
+    if (i > length) {
+        i = length;
+    }
+    memcpy(dst, src, i);
+    for (; i + 64 <= length; i += 64) {
+        _mm_stream_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+        _mm_stream_si128((__m128i*)(dst + i + 16), _mm_loadu_si128((const __m128i*)(src + i + 16)));
+        _mm_stream_si128((__m128i*)(dst + i + 32), _mm_loadu_si128((const __m128i*)(src + i + 32)));
+        _mm_stream_si128((__m128i*)(dst + i + 48), _mm_loadu_si128((const __m128i*)(src + i + 48)));
+    }
+    _mm_sfence();
+    memcpy(dst + i, src + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void stream_store_avx2(char* dst, const char* src, size_t length) {
+    size_t i = (size_t)(-(uintptr_t)dst & 31);
+    if (i > length) {
+        i = length;
+    }
+    memcpy(dst, src, i);
+    for (; i + 128 <= length; i += 128) {
+        _mm256_stream_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+        _mm256_stream_si256((__m256i*)(dst + i + 32), _mm256_loadu_si256((const __m256i*)(src + i + 32)));
+        _mm256_stream_si256((__m256i*)(dst + i + 64), _mm256_loadu_si256((const __m256i*)(src + i + 64)));
+        _mm256_stream_si256((__m256i*)(dst + i + 96), _mm256_loadu_si256((const __m256i*)(src + i + 96)));
+    }
+    _mm_sfence();
+    memcpy(dst + i, src + i, length - i);
+}
+#endif
+
+void select_simd_kernels() {
+    #if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        zero_check = buffer_is_zero_avx2;
+        pattern_generator = xoshiro_fill_avx2;
+        stream_store = stream_store_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        zero_check = buffer_is_zero_sse2;
+        stream_store = stream_store_sse2;
+    }
+    #elif defined(__aarch64__)
+    zero_check = buffer_is_zero_neon;
+    #endif
+}
+
+int buffer_is_zero(const char* data, size_t length) {
+    pthread_once(&simd_once, select_simd_kernels);
+    return zero_check(data, length);
+}
+
+void store_nontemporal(char* dst, const char* src, size_t length) {
+    pthread_once(&simd_once, select_simd_kernels);
+    stream_store(dst, src, length);
+}
+
+unsigned long long splitmix64(unsigned long long* state) {
+    unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Random passes must be reproducible for the read-back, so the seed comes
+// from the drive's identity rather than the clock.
+unsigned long long pattern_seed(struct wipe_job* job, unsigned pass) {
+    char key[512];
+    if (wipe_identity(job, key, sizeof(key)) != 0) {
+        snprintf(key, sizeof(key), "%s", job->device_path);
+    }
+    unsigned long long state = hash_bytes(key, strlen(key), 0xcbf29ce484222325ULL) + pass;
+    return splitmix64(&state);
+}
+
+// Every PATTERN_BLOCK_SIZE block of a random pass has its own generator
+// state, so any range can be produced independently of the others.
+void seed_pattern_block(unsigned long long seed, unsigned long long block, uint64_t state[4][PATTERN_LANES]) {
+    unsigned long long mix = seed ^ (block * 0xd1342543de82ef95ULL);
+    for (int word = 0; word < 4; word++) {
+        for (int lane = 0; lane < PATTERN_LANES; lane++) {
+            state[word][lane] = splitmix64(&mix);
+        }
+    }
+}
+
+// PATTERN_LANES interleaved xoshiro256+ generators, 32 bytes per step.
+void xoshiro_fill_scalar(uint64_t state[4][PATTERN_LANES], char* out, size_t length) {
+    for (size_t i = 0; i + 8 * PATTERN_LANES <= length; i += 8 * PATTERN_LANES) {
+        uint64_t words[PATTERN_LANES];
+        for (int lane = 0; lane < PATTERN_LANES; lane++) {
+            uint64_t t = state[1][lane] << 17;
+            words[lane] = state[0][lane] + state[3][lane];
+            state[2][lane] ^= state[0][lane];
+            state[3][lane] ^= state[1][lane];
+            state[1][lane] ^= state[2][lane];
+            state[0][lane] ^= state[3][lane];
+            state[2][lane] ^= t;
+            state[3][lane] = (state[3][lane] << 45) | (state[3][lane] >> 19);
+        }
+        memcpy(out + i, words, sizeof(words));
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void xoshiro_fill_avx2(uint64_t state[4][PATTERN_LANES], char* out, size_t length) {
+    __m256i s0 = _mm256_loadu_si256((const __m256i*)state[0]);
+    __m256i s1 = _mm256_loadu_si256((const __m256i*)state[1]);
+    __m256i s2 = _mm256_loadu_si256((const __m256i*)state[2]);
+    __m256i s3 = _mm256_loadu_si256((const __m256i*)state[3]);
+
+    for (size_t i = 0; i + 32 <= length; i += 32) {
+        __m256i t = _mm256_slli_epi64(s1, 17);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi64(s0, s3));
+        s2 = _mm256_xor_si256(s2, s0);
+        s3 = _mm256_xor_si256(s3, s1);
+        s1 = _mm256_xor_si256(s1, s2);
+        s0 = _mm256_xor_si256(s0, s3);
+        s2 = _mm256_xor_si256(s2, t);
+        s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+    }
+
+    _mm256_storeu_si256((__m256i*)state[0], s0);
+    _mm256_storeu_si256((__m256i*)state[1], s1);
+    _mm256_storeu_si256((__m256i*)state[2], s2);
+    _mm256_storeu_si256((__m256i*)state[3], s3);
+}
+#endif
+
+// Writes the bytes the pass puts at [offset, offset + length) into buffer.
+void fill_pattern(const struct wipe_pass* pass, unsigned long long seed, off_t offset, char* buffer, size_t length) {
+    if (!pass || pass->kind != PATTERN_RANDOM) {
+        memset(buffer, pass && pass->kind == PATTERN_BYTE ? pass->byte : 0, length);
+        return;
+    }
+    pthread_once(&simd_once, select_simd_kernels);
+
+    char partial[PATTERN_BLOCK_SIZE];
+    while (length > 0) {
+        unsigned long long block = (unsigned long long)offset / PATTERN_BLOCK_SIZE;
+        size_t skip = (size_t)(offset % PATTERN_BLOCK_SIZE);
+        size_t chunk = PATTERN_BLOCK_SIZE - skip < length ? PATTERN_BLOCK_SIZE - skip : length;
+
+        uint64_t state[4][PATTERN_LANES];
+        seed_pattern_block(seed, block, state);
+        if (chunk == PATTERN_BLOCK_SIZE) {
+            pattern_generator(state, buffer, PATTERN_BLOCK_SIZE);
+        } else {
+            pattern_generator(state, partial, PATTERN_BLOCK_SIZE);
+            memcpy(buffer, partial + skip, chunk);
+        }
+
+        buffer += chunk;
+        offset += (off_t)chunk;
+        length -= chunk;
+    }
+}
+
+int pattern_matches(const struct wipe_pass* pass, const char* data, const char* expected, size_t length) {
+    if (!pass || pass->kind == PATTERN_ZERO) {
+        return buffer_is_zero(data, length);
+    }
+    return memcmp(data, expected, length) == 0;
+}
+
+void constant_pattern_stream(struct pattern_stream* stream, const char* buffer, size_t buffer_size,
+                             off_t start, off_t end) {
+    memset(stream, 0, sizeof(*stream));
+    stream->start = start;
+    stream->end = end;
+    stream->chunk_size = buffer_size;
+    stream->buffer = (char*)buffer;
+    stream->buffer_size = buffer_size;
+}
+
+// buffer already holds a zero or fixed-byte pass; a random pass gets a ring
+// deep enough for every io_uring write in flight plus PATTERN_LOOKAHEAD
+// chunks the producers fill ahead of the writer.
+int open_pattern_stream(struct pattern_stream* stream, struct wipe_target* target, char* buffer,
+                        size_t buffer_size, off_t start, off_t end) {
+    constant_pattern_stream(stream, buffer, buffer_size, start, end);
+    if (!target->pass || target->pass->kind != PATTERN_RANDOM) {
+        return 0;
+    }
+
+    stream->pass = target->pass;
+    stream->seed = target->seed;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    stream->slot_count = options.queue_depth + PATTERN_LOOKAHEAD;
+    stream->buffer_size = buffer_size * stream->slot_count;
+    stream->buffer = alloc_io_buffer(stream->buffer_size, target->alignment);
+    stream->slot_sequence = (long long*)malloc(stream->slot_count * sizeof(long long));
+    stream->slot_ready = (int*)calloc(stream->slot_count, sizeof(int));
+    if (!stream->buffer || !stream->slot_sequence || !stream->slot_ready) {
+        close_pattern_stream(stream);
+        return -1;
+    }
+    for (unsigned i = 0; i < stream->slot_count; i++) {
+        stream->slot_sequence[i] = -1;
+    }
+
+    for (unsigned i = 0; i < PATTERN_PRODUCERS; i++) {
+        if (pthread_create(&stream->producers[stream->producer_count], NULL,
+                           pattern_producer_thread, stream) == 0) {
+            stream->producer_count++;
+        }
+    }
+    if (stream->producer_count == 0) {
+        close_pattern_stream(stream);
+        return -1;
+    }
+    return 0;
+}
+
+void close_pattern_stream(struct pattern_stream* stream) {
+    if (!stream->pass) {
+        return;
+    }
+
+    if (stream->producer_count > 0) {
+        pthread_mutex_lock(&stream->lock);
+        stream->stopping = 1;
+        pthread_cond_broadcast(&stream->changed);
+        pthread_mutex_unlock(&stream->lock);
+        for (unsigned i = 0; i < stream->producer_count; i++) {
+            pthread_join(stream->producers[i], NULL);
+        }
+    }
+    pthread_cond_destroy(&stream->changed);
+    pthread_mutex_destroy(&stream->lock);
+    free(stream->buffer);
+    free(stream->slot_sequence);
+    free(stream->slot_ready);
+    memset(stream, 0, sizeof(*stream));
+}
+
+void* pattern_producer_thread(void* arg) {
+    struct pattern_stream* stream = (struct pattern_stream*)arg;
+
+    pthread_mutex_lock(&stream->lock);
+    while (!stream->stopping) {
+        long long sequence = stream->next_sequence;
+        off_t offset = stream->start + sequence * (off_t)stream->chunk_size;
+        if (offset >= stream->end) {
+            break;
+        }
+
+        unsigned slot = (unsigned)(sequence % stream->slot_count);
+        if (stream->slot_sequence[slot] != -1) {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+            continue;
+        }
+        stream->slot_sequence[slot] = sequence;
+        stream->slot_ready[slot] = 0;
+        stream->next_sequence++;
+        pthread_mutex_unlock(&stream->lock);
+
+        size_t length = stream->end - offset < (off_t)stream->chunk_size
+                        ? (size_t)(stream->end - offset) : stream->chunk_size;
+        fill_pattern(stream->pass, stream->seed, offset, stream->buffer + slot * stream->chunk_size, length);
+
+        pthread_mutex_lock(&stream->lock);
+        stream->slot_ready[slot] = 1;
+        pthread_cond_broadcast(&stream->changed);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+char* acquire_pattern_chunk(struct pattern_stream* stream, long long sequence) {
+    if (!stream->pass) {
+        return stream->buffer;
+    }
+
+    unsigned slot = (unsigned)(sequence % stream->slot_count);
+    pthread_mutex_lock(&stream->lock);
+    while (stream->slot_sequence[slot] != sequence || !stream->slot_ready[slot]) {
+        pthread_cond_wait(&stream->changed, &stream->lock);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return stream->buffer + slot * stream->chunk_size;
+}
+
+void release_pattern_chunk(struct pattern_stream* stream, long long sequence) {
+    if (!stream->pass) {
+        return;
+    }
+
+    unsigned slot = (unsigned)(sequence % stream->slot_count);
+    pthread_mutex_lock(&stream->lock);
+    if (stream->slot_sequence[slot] == sequence) {
+        stream->slot_sequence[slot] = -1;
+        stream->slot_ready[slot] = 0;
+        pthread_cond_broadcast(&stream->changed);
+    }
+    pthread_mutex_unlock(&stream->lock);
+}
+
+int open_verify_fd(const char* device_path) {
+    if (backend_for_path(device_path) != &block_backend) {
+        return device_open(device_path, O_RDONLY);
+    }
+    #ifdef __APPLE__
+    int fd = open(device_path, O_RDONLY);
+    if (fd != -1) {
+        fcntl(fd, F_NOCACHE, 1);
+    }
+    return fd;
+    #else
+    int fd = open(device_path, O_RDONLY | O_DIRECT);
+    if (fd == -1 && errno == EINVAL) {
+        fd = open(device_path, O_RDONLY);
+    }
+    return fd;
+    #endif
+}
+
+// Records every block of [start, end) that does not read back as the
+// pattern of the pass. A failed or short read counts as a mismatch for the
+// unread part.
+int verify_range(struct verifier* verifier, char* buffer, char* expected, off_t start, off_t end) {
+    struct extent_map* mismatches = &verifier->job->mismatched_extents;
+    size_t length = (size_t)(end - start);
+    size_t block = verifier->block_size;
+    size_t read_length = (length + block - 1) / block * block;
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = device_pread(verifier->fd, buffer, read_length, start);
+    } while (bytes_read == -1 && errno == EINTR);
+
+    size_t valid = bytes_read > 0 ? (size_t)bytes_read / block * block : 0;
+    if (valid > length) {
+        valid = length;
+    }
+    if (valid < length && add_extent(mismatches, start + (off_t)valid, end) != 0) {
+        return -1;
+    }
+    if (verifier->pass->kind != PATTERN_ZERO) {
+        fill_pattern(verifier->pass, verifier->seed, start, expected, valid);
+    }
+    if (pattern_matches(verifier->pass, buffer, expected, valid)) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < valid; i += block) {
+        size_t chunk = valid - i < block ? valid - i : block;
+        if (!pattern_matches(verifier->pass, buffer + i, expected + i, chunk) &&
+            add_extent(mismatches, start + (off_t)i, start + (off_t)(i + chunk)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void* verify_thread(void* arg) {
+    struct verifier* verifier = (struct verifier*)arg;
+    struct wipe_metrics* metrics = verifier->job->metrics;
+    off_t offset = verifier->start;
+
+    char* buffer = alloc_io_buffer(VERIFY_BUFFER_SIZE, verifier->alignment);
+    char* expected = verifier->pass->kind != PATTERN_ZERO ? (char*)malloc(VERIFY_BUFFER_SIZE) : NULL;
+    if (!buffer || (verifier->pass->kind != PATTERN_ZERO && !expected)) {
+        free(buffer);
+        free(expected);
+        verifier->failed = 1;
+        return NULL;
+    }
+
+    while (offset < verifier->end) {
+        if (wipe_cancelled(verifier->job)) {
+            verifier->failed = 1;
+            break;
+        }
+        int writer_done = atomic_load_explicit(&verifier->writer_done, memory_order_acquire);
+        off_t limit = (off_t)atomic_load_explicit(&verifier->written, memory_order_acquire);
+        if (!writer_done) {
+            limit -= (off_t)options.verify_window;
+        }
+        if (limit > verifier->end) {
+            limit = verifier->end;
+        }
+
+        if (offset >= limit) {
+            if (writer_done) {
+                break;
+            }
+            poll(NULL, 0, VERIFY_POLL_MS);
+            continue;
+        }
+
+        // Holes in a file were never written and read back as zeros
+        // whatever the pass, so only the data extents are compared.
+        if (verifier->sparse) {
+            off_t data = lseek(verifier->fd, offset, SEEK_DATA);
+            if (data == -1 && errno == ENXIO) {
+                data = limit;
+            }
+            if (data > offset) {
+                offset = data < limit ? data : limit;
+                verifier->verified = offset;
+                if (metrics) {
+                    atomic_store(&metrics->bytes_verified, (unsigned long long)offset);
+                }
+                continue;
+            }
+        }
+
+        off_t end = limit - offset > VERIFY_BUFFER_SIZE ? offset + VERIFY_BUFFER_SIZE : limit;
+        if (verifier->sparse) {
+            off_t hole = lseek(verifier->fd, offset, SEEK_HOLE);
+            if (hole > offset && hole < end) {
+                end = hole;
+            }
+        }
+        throttle_io(verifier->job, (unsigned long long)(end - offset));
+        if (verify_range(verifier, buffer, expected, offset, end) != 0) {
+            verifier->failed = 1;
+            break;
+        }
+        offset = end;
+        if (metrics) {
+            atomic_store_explicit(&metrics->bytes_verified, (unsigned long long)offset, memory_order_relaxed);
+        }
+    }
+
+    verifier->verified = offset;
+    free(buffer);
+    free(expected);
+    return NULL;
+}
+
+int start_verifier(struct wipe_target* target, struct verifier* verifier, off_t start) {
+    struct wipe_job* job = target->job;
+
+    memset(verifier, 0, sizeof(*verifier));
+    verifier->job = job;
+    verifier->pass = target->pass;
+    verifier->seed = target->seed;
+    verifier->fd = open_verify_fd(job->device_path);
+    if (verifier->fd == -1) {
+        return -1;
+    }
+    verifier->block_size = target->logical_block_size < 512 ? 512 : target->logical_block_size;
+    verifier->alignment = target->alignment;
+    verifier->start = job->verified_offset < start ? job->verified_offset : start;
+    verifier->end = target->size;
+    verifier->sparse = target->regular_file;
+    atomic_store(&verifier->written, (long long)start);
+    atomic_store(&verifier->writer_done, 0);
+    if (job->metrics) {
+        atomic_store(&job->metrics->bytes_verified, (unsigned long long)verifier->start);
+    }
+
+    if (pthread_create(&verifier->thread, NULL, verify_thread, verifier) != 0) {
+        device_close(verifier->fd);
+        return -1;
+    }
+    target->verifier = verifier;
+    return 0;
+}
+
+int recheck_block(struct wipe_target* target, int fd, char* expected, char* read_buffer, off_t start, off_t end) {
+    size_t length = (size_t)(end - start);
+    fill_pattern(target->pass, target->seed, start, expected, length);
+    if (pwrite_all(target->fd, expected, length, start) != 0) {
+        return -1;
+    }
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = device_pread(fd, read_buffer, length, start);
+    } while (bytes_read == -1 && errno == EINTR);
+
+    return bytes_read == (ssize_t)length && memcmp(read_buffer, expected, length) == 0 ? 0 : -1;
+}
+
+// Lets the verify thread catch up with the end of the fill, then rewrites
+// and rereads every block that did not match. Blocks that still do not read
+// back as the pattern mean the drive is dropping writes.
+int finish_verifier(struct wipe_target* target, struct verifier* verifier, int fill_result) {
+    struct wipe_job* job = target->job;
+    struct extent_map* mismatches = &job->mismatched_extents;
+
+    if (fill_result == 0) {
+        set_wipe_phase(job, PHASE_VERIFY);
+    }
+    atomic_store_explicit(&verifier->writer_done, 1, memory_order_release);
+    pthread_join(verifier->thread, NULL);
+    target->verifier = NULL;
+    job->verified_offset = verifier->verified;
+
+    int result = fill_result;
+    if (result == 0 && (verifier->failed || verifier->verified < target->size)) {
+        result = -1;
+    }
+
+    off_t mismatched_bytes = 0;
+    for (size_t i = 0; i < mismatches->count; i++) {
+        mismatched_bytes += mismatches->extents[i].end - mismatches->extents[i].start;
+    }
+
+    // Too much to rewrite block by block; the drive is not holding writes.
+    if (result == 0 && mismatched_bytes > VERIFY_RECHECK_LIMIT) {
+        job->verify_failed = 1;
+        result = -1;
+    } else if (result == 0 && mismatches->count > 0) {
+        struct extent_map remaining = { NULL, 0, 0 };
+        off_t block = verifier->block_size;
+        char* read_buffer = alloc_io_buffer((size_t)block, verifier->alignment);
+        char* expected = alloc_io_buffer((size_t)block, verifier->alignment);
+
+        for (size_t i = 0; i < mismatches->count; i++) {
+            for (off_t start = mismatches->extents[i].start; start < mismatches->extents[i].end; start += block) {
+                off_t end = start + block < mismatches->extents[i].end ? start + block : mismatches->extents[i].end;
+                if (extent_overlaps(&job->bad_extents, start, end)) {
+                    continue;
+                }
+                if (!read_buffer || !expected ||
+                    recheck_block(target, verifier->fd, expected, read_buffer, start, end) != 0) {
+                    add_extent(&remaining, start, end);
+                }
+            }
+        }
+
+        free(read_buffer);
+        free(expected);
+        free(mismatches->extents);
+        *mismatches = remaining;
+        if (mismatches->count > 0) {
+            job->verify_failed = 1;
+            result = -1;
+        }
+    }
+
+    device_close(verifier->fd);
+    return result;
+}
+#endif
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+int read_sysfs_ull(const char* path, unsigned long long* value) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    int matched = fscanf(file, "%llu", value);
+    fclose(file);
+    return matched == 1 ? 0 : -1;
+}
+
+int read_queue_limit(dev_t devnum, const char* name, unsigned long long* value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s", major(devnum), minor(devnum), name);
+    if (read_sysfs_ull(path, value) == 0) {
+        return 0;
+    }
+
+    // Partitions have no queue directory of their own; use the parent disk's.
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s", major(devnum), minor(devnum), name);
+    return read_sysfs_ull(path, value);
+}
+
+int probe_offload_caps(const char* device_path, struct offload_caps* caps) {
+    memset(caps, 0, sizeof(*caps));
+
+    struct stat st;
+    if (stat(device_path, &st) != 0 || !S_ISBLK(st.st_mode)) {
+        return -1;
+    }
+
+    read_queue_limit(st.st_rdev, "discard_max_bytes", &caps->discard_max_bytes);
+    read_queue_limit(st.st_rdev, "discard_granularity", &caps->discard_granularity);
+    read_queue_limit(st.st_rdev, "write_zeroes_max_bytes", &caps->write_zeroes_max_bytes);
+    read_queue_limit(st.st_rdev, "discard_zeroes_data", &caps->discard_zeroes_data);
+
+    for (int method = 0; method < OFFLOAD_NONE; method++) {
+        if (offload_supported(caps, (enum offload_method)method)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int offload_supported(const struct offload_caps* caps, enum offload_method method) {
+    switch (method) {
+        // Discard only deallocates. It counts as zeroing only on a device
+        // that promises discarded blocks read back as zeros.
+        case OFFLOAD_SECDISCARD:
+        case OFFLOAD_DISCARD:
+            return caps->discard_max_bytes > 0 && caps->discard_zeroes_data > 0;
+        case OFFLOAD_ZEROOUT:
+            return caps->write_zeroes_max_bytes > 0;
+        default:
+            return 0;
+    }
+}
+
+int offload_range(int fd, enum offload_method method, off_t start, off_t end) {
+    uint64_t range[2] = { (uint64_t)start, (uint64_t)(end - start) };
+    unsigned long request;
+
+    switch (method) {
+        case OFFLOAD_SECDISCARD:
+            request = BLKSECDISCARD;
+            break;
+        case OFFLOAD_ZEROOUT:
+            request = BLKZEROOUT;
+            break;
+        case OFFLOAD_DISCARD:
+            request = BLKDISCARD;
+            break;
+        default:
+            return -1;
+    }
+
+    while (ioctl(fd, request, range) != 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int fill_with_offload(struct wipe_target* target, char* buffer, size_t buffer_size, off_t start) {
+    struct offload_caps caps;
+    if (!options.offload || probe_offload_caps(target->job->device_path, &caps) != 0) {
+        return fill_partitioned_range(target, buffer, buffer_size, start, target->size);
+    }
+
+    // The first method that leaves zeros behind is used throughout; a range
+    // the device refuses is written instead, and the next range tries again.
+    enum offload_method method = OFFLOAD_ZEROOUT;
+    while (!offload_supported(&caps, method)) {
+        method++;
+    }
+
+    off_t unit = target->logical_block_size;
+    if (method != OFFLOAD_ZEROOUT && (off_t)caps.discard_granularity > unit) {
+        unit = (off_t)caps.discard_granularity;
+    }
+
+    int result = 0;
+    while (result == 0 && start < target->size) {
+        if (wipe_cancelled(target->job)) {
+            result = -1;
+            break;
+        }
+
+        off_t end = start + OFFLOAD_CHUNK_SIZE;
+        if (end > target->size) {
+            end = target->size;
+        }
+
+        // Devices only deallocate whole discard granules; anything outside
+        // them is written the normal way.
+        off_t aligned_start = (start + unit - 1) / unit * unit;
+        off_t aligned_end = end / unit * unit;
+
+        if (aligned_end - aligned_start < (off_t)target->physical_block_size ||
+            offload_range(target->fd, method, aligned_start, aligned_end) != 0) {
+            result = fill_target_range(target, buffer, buffer_size, start, end, target->job->engine);
+        } else {
+            add_bytes_written(target->job, (unsigned long long)(aligned_end - aligned_start));
+            if (start < aligned_start) {
+                result = fill_target_range(target, buffer, buffer_size, start, aligned_start, target->job->engine);
+            }
+            if (result == 0 && aligned_end < end) {
+                result = fill_target_range(target, buffer, buffer_size, aligned_end, end, target->job->engine);
+            }
+        }
+        if (result == 0) {
+            record_fill_progress(target, end);
+        }
+        start = end;
+    }
+    return result;
+}
+
+int uring_init(struct uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->ring_fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_exit(ring);
+        return -1;
+    }
+
+    char* sq = (char*)ring->sq_ring;
+    char* cq = (char*)ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_exit(struct uring* ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+}
+
+int uring_register_target(struct uring* ring, int fd, char* buffer, size_t buffer_size) {
+    struct iovec iov = { buffer, buffer_size };
+
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+        return -1;
+    }
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_FILES, &fd, 1) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int uring_enter(struct uring* ring, unsigned to_submit, unsigned wait_nr) {
+    while (1) {
+        long ret = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            return (int)ret;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+int fill_range_uring(struct wipe_target* target, struct pattern_stream* stream, unsigned depth) {
+    struct uring ring;
+    if (uring_init(&ring, depth) != 0) {
+        return ENGINE_UNAVAILABLE;
+    }
+    if (uring_register_target(&ring, target->fd, stream->buffer, stream->buffer_size) != 0) {
+        uring_exit(&ring);
+        return ENGINE_UNAVAILABLE;
+    }
+
+    // Every write points into the registered pattern buffer; each in-flight
+    // request keeps its chunk of the pattern until it completes.
+    off_t slot_offset[MAX_QUEUE_DEPTH];
+    unsigned slot_length[MAX_QUEUE_DEPTH];
+    char* slot_data[MAX_QUEUE_DEPTH];
+    long long slot_sequence[MAX_QUEUE_DEPTH];
+    long long slot_started[MAX_QUEUE_DEPTH];
+    int slot_busy[MAX_QUEUE_DEPTH] = {0};
+    unsigned free_slots[MAX_QUEUE_DEPTH];
+    unsigned retry_slots[MAX_QUEUE_DEPTH];
+    unsigned free_count = depth;
+    unsigned retry_count = 0;
+    for (unsigned i = 0; i < depth; i++) {
+        free_slots[i] = depth - 1 - i;
+    }
+
+    off_t end = stream->end;
+    off_t next = stream->start;
+    long long sequence = 0;
+    unsigned inflight = 0;
+    unsigned pending = 0;
+    int failed = 0;
+
+    while (inflight > 0 || (!failed && (next < end || retry_count > 0))) {
+        unsigned tail = *ring.sq_tail;
+        if (wipe_cancelled(target->job)) {
+            failed = 1;
+        }
+
+        while (!failed && inflight + pending < depth && (retry_count > 0 || next < end)) {
+            unsigned slot;
+            if (retry_count > 0) {
+                slot = retry_slots[--retry_count];
+            } else {
+                char* data = acquire_pattern_chunk(stream, sequence);
+                if (!data) {
+                    failed = 1;
+                    break;
+                }
+                slot = free_slots[--free_count];
+                slot_busy[slot] = 1;
+                slot_data[slot] = data;
+                slot_sequence[slot] = sequence++;
+                slot_offset[slot] = next;
+                slot_length[slot] = (unsigned)stream->chunk_size;
+                if ((off_t)stream->chunk_size > end - next) {
+                    slot_length[slot] = (unsigned)(end - next);
+                }
+                next += slot_length[slot];
+                throttle_io(target->job, slot_length[slot]);
+            }
+
+            unsigned index = tail & *ring.sq_mask;
+            struct io_uring_sqe* sqe = &ring.sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 0;
+            sqe->addr = (unsigned long)slot_data[slot];
+            sqe->len = slot_length[slot];
+            sqe->off = (unsigned long long)slot_offset[slot];
+            sqe->buf_index = 0;
+            sqe->user_data = slot;
+            slot_started[slot] = write_latency ? monotonic_ns() : 0;
+            ring.sq_array[index] = index;
+            tail++;
+            pending++;
+        }
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+        if (failed && inflight + pending == 0) {
+            break;
+        }
+
+        int submitted = uring_enter(&ring, pending, 1);
+        if (submitted < 0) {
+            failed = 1;
+            break;
+        }
+        pending -= (unsigned)submitted;
+        inflight += (unsigned)submitted;
+
+        unsigned head = *ring.cq_head;
+        unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != cq_tail) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            unsigned slot = (unsigned)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            inflight--;
+            record_write_latency(slot_started[slot]);
+
+            if (res == -EINTR || res == -EAGAIN) {
+                retry_slots[retry_count++] = slot;
+            } else if (res <= 0) {
+                off_t slot_end = slot_offset[slot] + slot_length[slot];
+                if (res == 0 || !is_media_error(-res) ||
+                    recover_failed_range(target, slot_data[slot], slot_offset[slot], slot_end) != 0) {
+                    failed = 1;
+                } else {
+                    add_bytes_written(target->job, slot_length[slot]);
+                    slot_busy[slot] = 0;
+                }
+                release_pattern_chunk(stream, slot_sequence[slot]);
+                free_slots[free_count++] = slot;
+            } else if ((unsigned)res < slot_length[slot]) {
+                add_bytes_written(target->job, (unsigned long long)res);
+                slot_offset[slot] += res;
+                slot_data[slot] += res;
+                slot_length[slot] -= (unsigned)res;
+                retry_slots[retry_count++] = slot;
+            } else {
+                add_bytes_written(target->job, (unsigned long long)res);
+                slot_busy[slot] = 0;
+                release_pattern_chunk(stream, slot_sequence[slot]);
+                free_slots[free_count++] = slot;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        // Completions arrive out of order; only the start of the oldest
+        // unfinished write is safe to resume from.
+        if (!failed) {
+            off_t done = next;
+            for (unsigned i = 0; i < depth; i++) {
+                if (slot_busy[i] && slot_offset[i] < done) {
+                    done = slot_offset[i];
+                }
+            }
+            record_fill_progress(target, done);
+        }
+    }
+
+    // Closing the ring waits for any requests still in flight after an error.
+    uring_exit(&ring);
+    return failed ? -1 : 0;
+}
+#endif
+
+#ifdef _WIN32
+int is_system_drive_win(const char* device_path) {
+    char system_dir[MAX_PATH];
+    if (!GetSystemDirectoryA(system_dir, MAX_PATH)) {
+        return 0;
+    }
+
+    char system_drive[4] = { system_dir[0], ':', '\\', '\0' };
+
+    char volume_path[MAX_PATH];
+    if (!GetVolumeNameForVolumeMountPointA(system_drive, volume_path, MAX_PATH)) {
+        return 0;
+    }
+
+    HANDLE hVolume = CreateFileA(volume_path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+
+    STORAGE_DEVICE_NUMBER sdn;
+    DWORD bytesReturned;
+    BOOL result = DeviceIoControl(hVolume, IOCTL_STORAGE_GET_DEVICE_NUMBER,
+                                  NULL, 0, &sdn, sizeof(sdn), &bytesReturned, NULL);
+    CloseHandle(hVolume);
+
+    if (!result) {
+        return 0;
+    }
+
+    int drive_number;
+    if (sscanf(device_path, "\\\\.\\PhysicalDrive%d", &drive_number) == 1) {
+        return drive_number == sdn.DeviceNumber;
+    }
+
+    return 0;
+}
+#elif __APPLE__
+int is_system_drive_mac(const char* device_path) {
+    struct statfs root_fs;
+    if (statfs("/", &root_fs) != 0) {
+        return 0;
+    }
+
+    char root_device[PATH_MAX];
+    if (realpath(root_fs.f_mntfromname, root_device) == NULL) {
+        return 0;
+    }
+
+    return strcmp(device_path, root_device) == 0;
+}
+#else
+struct protection_index protection_index = { PTHREAD_MUTEX_INITIALIZER, { NULL, 0, 0 }, 1 };
+
+size_t device_slot(dev_t dev, size_t capacity) {
+    unsigned long long state = (unsigned long long)dev;
+    return (size_t)(splitmix64(&state) & (capacity - 1));
+}
+
+// Open-addressed set of block device numbers; 0 marks an empty slot, which
+// is safe because no block device is 0:0.
+int device_set_add(struct device_set* set, dev_t dev) {
+    if ((set->count + 1) * 2 > set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 64;
+        dev_t* slots = calloc(capacity, sizeof(dev_t));
+        if (!slots) {
+            return -1;
+        }
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (set->slots[i] != 0) {
+                size_t slot = device_slot(set->slots[i], capacity);
+                while (slots[slot] != 0) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                slots[slot] = set->slots[i];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+
+    size_t slot = device_slot(dev, set->capacity);
+    while (set->slots[slot] != 0) {
+        if (set->slots[slot] == dev) {
+            return 0;
+        }
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    set->slots[slot] = dev;
+    set->count++;
+    return 1;
+}
+
+int device_set_contains(const struct device_set* set, dev_t dev) {
+    if (set->capacity == 0 || dev == 0) {
+        return 0;
+    }
+    size_t slot = device_slot(dev, set->capacity);
+    while (set->slots[slot] != 0) {
+        if (set->slots[slot] == dev) {
+            return 1;
+        }
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    return 0;
+}
+
+void device_set_free(struct device_set* set) {
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+int read_sysfs_devt(const char* path, dev_t* dev) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    unsigned dev_major, dev_minor;
+    int matched = fscanf(file, "%u:%u", &dev_major, &dev_minor);
+    fclose(file);
+    if (matched != 2) {
+        return -1;
+    }
+    *dev = makedev(dev_major, dev_minor);
+    return 0;
+}
+
+// Adds dev and everything that shares its storage stack: the whole disk
+// under a partition, the partitions of a disk, and the slaves and holders
+// of each, so a root on LVM over md over sda2 protects sda and sdb alike.
+// Returns 1 when dev was new, 0 when it was already in, -1 on failure.
+int protect_device_stack(struct device_set* set, dev_t dev) {
+    int added = device_set_add(set, dev);
+    if (added != 1) {
+        return added;
+    }
+
+    // A path cut short would silently skip part of the stack, so truncation
+    // fails the whole index like a failed allocation does.
+    char base[PATH_MAX];
+    char path[PATH_MAX];
+    if ((size_t)snprintf(base, sizeof(base), "/sys/dev/block/%u:%u", major(dev), minor(dev)) >= sizeof(base)) {
+        return -1;
+    }
+
+    dev_t related;
+    if ((size_t)snprintf(path, sizeof(path), "%s/partition", base) >= sizeof(path)) {
+        return -1;
+    }
+    if (access(path, F_OK) == 0) {
+        if ((size_t)snprintf(path, sizeof(path), "%s/../dev", base) >= sizeof(path)) {
+            return -1;
+        }
+        if (read_sysfs_devt(path, &related) == 0 && protect_device_stack(set, related) < 0) {
+            return -1;
+        }
+    }
+
+    const char* links[] = { "slaves", "holders", "." };
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", base, links[i]) >= sizeof(path)) {
+            return -1;
+        }
+        DIR* dir = opendir(path);
+        if (!dir) {
+            continue;
+        }
+        int result = 0;
+        struct dirent* entry;
+        while (result == 0 && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            if (i == 2) {
+                // Only subdirectories with a partition file are partitions.
+                if ((size_t)snprintf(path, sizeof(path), "%s/%s/partition", base, entry->d_name) >= sizeof(path)) {
+                    result = -1;
+                    break;
+                }
+                if (access(path, F_OK) != 0) {
+                    continue;
+                }
+            }
+            if ((size_t)snprintf(path, sizeof(path), "%s/%s/%s/dev", base, links[i], entry->d_name) >= sizeof(path)) {
+                result = -1;
+            } else if (read_sysfs_devt(path, &related) == 0 && protect_device_stack(set, related) < 0) {
+                result = -1;
+            }
+        }
+        closedir(dir);
+        if (result != 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int build_protection_index(struct device_set* set) {
+    FILE* file = fopen("/proc/self/mountinfo", "r");
+    if (!file) {
+        return -1;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), file)) {
+        unsigned dev_major, dev_minor;
+        if (sscanf(line, "%*u %*u %u:%u", &dev_major, &dev_minor) != 2) {
+            continue;
+        }
+
+        dev_t dev = makedev(dev_major, dev_minor);
+        if (dev_major == 0) {
+            // btrfs and friends report an anonymous device; fall back to
+            // the mount source named after the " - fstype" separator.
+            char source[PATH_MAX];
+            char* separator = strstr(line, " - ");
+            struct stat st;
+            if (!separator || sscanf(separator + 3, "%*s %4095s", source) != 1 ||
+                stat(source, &st) != 0 || !S_ISBLK(st.st_mode)) {
+                continue;
+            }
+            dev = st.st_rdev;
+        }
+        if (protect_device_stack(set, dev) < 0) {
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+
+    file = fopen("/proc/swaps", "r");
+    if (file) {
+        while (fgets(line, sizeof(line), file)) {
+            char swap_path[PATH_MAX];
+            struct stat st;
+            if (sscanf(line, "%4095s", swap_path) != 1 || swap_path[0] != '/' || stat(swap_path, &st) != 0) {
+                continue;
+            }
+            if (protect_device_stack(set, S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev) < 0) {
+                fclose(file);
+                return -1;
+            }
+        }
+        fclose(file);
+    }
+    return 0;
+}
+
+void invalidate_protection_index() {
+    pthread_mutex_lock(&protection_index.lock);
+    protection_index.stale = 1;
+    pthread_mutex_unlock(&protection_index.lock);
+}
+
+// A device created after the last rebuild, such as a new LV on the system
+// disk, is caught by walking its slaves down to something indexed.
+int stack_rests_on_protected(dev_t dev, int depth) {
+    if (device_set_contains(&protection_index.devices, dev)) {
+        return 1;
+    }
+    if (depth >= 8) {
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves", major(dev), minor(dev));
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+    int found = 0;
+    struct dirent* entry;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        dev_t slave;
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves/%s/dev", major(dev), minor(dev), entry->d_name);
+        if (read_sysfs_devt(path, &slave) == 0) {
+            found = stack_rests_on_protected(slave, depth + 1);
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+// Fails closed: a device that cannot be looked at, or any device while the
+// mounts cannot be read, counts as a system drive.
+int is_system_drive_linux(const char* device_path) {
+    struct stat st;
+    if (stat(device_path, &st) != 0) {
+        return 1;
+    }
+    if (!S_ISBLK(st.st_mode)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&protection_index.lock);
+    if (protection_index.stale) {
+        struct device_set rebuilt = { NULL, 0, 0 };
+        if (build_protection_index(&rebuilt) == 0) {
+            device_set_free(&protection_index.devices);
+            protection_index.devices = rebuilt;
+            protection_index.stale = 0;
+        } else {
+            device_set_free(&rebuilt);
+        }
+    }
+    int protected_device = protection_index.stale || stack_rests_on_protected(st.st_rdev, 0);
+    pthread_mutex_unlock(&protection_index.lock);
+    return protected_device;
+}
+#endif
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+struct wipe_pool wipe_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL
+};
+atomic_uint listed_failures;
+
+void get_bus_key(struct udev_device* dev, char* key, size_t key_size) {
+    const char* usb_root = NULL;
+    const char* controller = NULL;
+
+    // The topmost USB device in the chain is the root hub, which every
+    // drive behind the same host port shares; otherwise fall back to the
+    // PCI function of the storage controller.
+    for (struct udev_device* parent = udev_device_get_parent(dev); parent;
+         parent = udev_device_get_parent(parent)) {
+        const char* subsystem = udev_device_get_subsystem(parent);
+        const char* devtype = udev_device_get_devtype(parent);
+        if (!subsystem) {
+            continue;
+        }
+        if (strcmp(subsystem, "usb") == 0 && devtype && strcmp(devtype, "usb_device") == 0) {
+            usb_root = udev_device_get_syspath(parent);
+        } else if (!controller && strcmp(subsystem, "pci") == 0) {
+            controller = udev_device_get_syspath(parent);
+        }
+    }
+
+    const char* group = usb_root ? usb_root : controller;
+    if (!group) {
+        group = udev_device_get_syspath(dev);
+    }
+    snprintf(key, key_size, "%s", group ? group : "");
+}
+
+// "usb-hdd", "nvme-ssd" and the like: the transport udev reports or, failing
+// that, the kernel name without its unit number, and whether the disk spins.
+void describe_device_class(dev_t devnum, const char* devnode, const char* transport, char* text, size_t text_size) {
+    const char* name = strrchr(devnode, '/');
+    name = name ? name + 1 : devnode;
+    int length = (int)strcspn(name, "0123456789");
+    // In sda or vdb the trailing letter numbers the disk as well.
+    if (length > 2 && (strncmp(name, "sd", 2) == 0 || strncmp(name, "vd", 2) == 0 || strncmp(name, "hd", 2) == 0)) {
+        length = 2;
+    }
+
+    unsigned long long rotational = 0;
+    read_queue_limit(devnum, "rotational", &rotational);
+    if (transport && transport[0]) {
+        snprintf(text, text_size, "%s-%s", transport, rotational ? "hdd" : "ssd");
+    } else {
+        snprintf(text, text_size, "%.*s-%s", length, name, rotational ? "hdd" : "ssd");
+    }
+}
+
+struct wipe_job* create_wipe_job(struct udev_device* dev, const char* devnode) {
+    struct wipe_job* job = (struct wipe_job*)calloc(1, sizeof(*job));
+    if (!job) {
+        return NULL;
+    }
+
+    job->device_path = strdup(devnode);
+    if (!job->device_path) {
+        free(job);
+        return NULL;
+    }
+
+    const char* sectors = udev_device_get_sysattr_value(dev, "size");
+    if (sectors) {
+        job->size = strtoull(sectors, NULL, 10) * 512;
+    }
+    const char* serial = udev_device_get_property_value(dev, "ID_SERIAL");
+    const char* wwn = udev_device_get_property_value(dev, "ID_WWN");
+    snprintf(job->serial, sizeof(job->serial), "%s", serial ? serial : "");
+    snprintf(job->wwn, sizeof(job->wwn), "%s", wwn ? wwn : "");
+    job->devnum = udev_device_get_devnum(dev);
+    describe_device_class(job->devnum, devnode, udev_device_get_property_value(dev, "ID_BUS"),
+                          job->device_class, sizeof(job->device_class));
+
+    get_bus_key(dev, job->bus, sizeof(job->bus));
+    job->metrics = claim_metrics(job->device_path, job->bus, job->size);
+    return job;
+}
+
+void free_wipe_job(struct wipe_job* job) {
+    release_metrics(job->metrics);
+    free(job->bad_extents.extents);
+    free(job->mismatched_extents.extents);
+    free(job->device_path);
+    free(job);
+}
+
+struct bus_group* find_bus_group(const char* bus) {
+    struct bus_group* group;
+    for (group = wipe_pool.groups; group; group = group->next) {
+        if (strcmp(group->bus, bus) == 0) {
+            return group;
+        }
+    }
+
+    group = (struct bus_group*)calloc(1, sizeof(*group));
+    if (!group) {
+        return NULL;
+    }
+    snprintf(group->bus, sizeof(group->bus), "%s", bus);
+    group->next = wipe_pool.groups;
+    wipe_pool.groups = group;
+    return group;
+}
+
+int start_wipe_pool(unsigned workers) {
+    unsigned started = 0;
+    for (unsigned i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, wipe_worker_thread, NULL) == 0) {
+            pthread_detach(thread);
+            started++;
+        }
+    }
+    return started > 0 ? 0 : -1;
+}
+
+void submit_wipe_job(struct wipe_job* job) {
+    if (job) {
+        submit_wipe_jobs(&job, 1);
     }
-    memset(zero_buffer, 0, FILL_BUFFER_SIZE);
+}
 
-    DWORD bytesWritten;
+int compare_job_size(const void* a, const void* b) {
+    const struct wipe_job* left = *(const struct wipe_job* const*)a;
+    const struct wipe_job* right = *(const struct wipe_job* const*)b;
+    return left->size < right->size ? -1 : left->size > right->size;
+}
 
-    if (!WriteFile(hDevice, zero_buffer, FILL_BUFFER_SIZE, &bytesWritten, NULL) ||
-        bytesWritten != FILL_BUFFER_SIZE) {
-        free(zero_buffer);
-    CloseHandle(hDevice);
-    return -1;
+// Queues a batch under one lock and wakes the workers once, smallest disk
+// at the head so ties in take_next_job() go the same way. Jobs that are not
+// queued are freed, and their slots in jobs are cleared.
+void submit_wipe_jobs(struct wipe_job** jobs, unsigned count) {
+    qsort(jobs, count, sizeof(*jobs), compare_job_size);
+
+    pthread_mutex_lock(&wipe_pool.lock);
+    for (unsigned i = count; i-- > 0;) {
+        struct wipe_job* job = jobs[i];
+        // Enumeration and the monitor overlap on purpose, and udev repeats add
+        // events; a disk already queued or being wiped is not wiped twice.
+        struct wipe_job* existing = find_registered_job(job->devnum);
+        if ((existing && !atomic_load(&existing->cancelled)) || !(job->group = find_bus_group(job->bus))) {
+            continue;
         }
+        job->next = wipe_pool.queue;
+        wipe_pool.queue = job;
+        job->registry_next = wipe_pool.registry;
+        wipe_pool.registry = job;
+        jobs[i] = NULL;
+    }
+    pthread_cond_broadcast(&wipe_pool.changed);
+    pthread_mutex_unlock(&wipe_pool.lock);
 
-        unsigned long long disk_size = 0;
-        if (!get_disk_size_win(hDevice, &disk_size)) {
-            free(zero_buffer);
-            CloseHandle(hDevice);
-            return -1;
+    for (unsigned i = 0; i < count; i++) {
+        if (jobs[i]) {
+            free_wipe_job(jobs[i]);
+            jobs[i] = NULL;
         }
+    }
+}
 
-        if (disk_size > FILL_BUFFER_SIZE) {
-            LARGE_INTEGER pos;
-            pos.QuadPart = disk_size - FILL_BUFFER_SIZE;
-            SetFilePointerEx(hDevice, pos, NULL, FILE_BEGIN);
-
-            if (!WriteFile(hDevice, zero_buffer, FILL_BUFFER_SIZE, &bytesWritten, NULL) ||
-                bytesWritten != FILL_BUFFER_SIZE) {
-                free(zero_buffer);
-            CloseHandle(hDevice);
-            return -1;
-                }
+// Shortest job first among the jobs whose bus still has a free slot, so the
+// most drives finish per hour without oversubscribing a shared port.
+struct wipe_job* take_next_job() {
+    struct wipe_job** best = NULL;
+    for (struct wipe_job** link = &wipe_pool.queue; *link; link = &(*link)->next) {
+        struct wipe_job* job = *link;
+        if (job->group->active >= options.jobs_per_bus) {
+            continue;
+        }
+        if (!best || job->size < (*best)->size) {
+            best = link;
         }
+    }
 
-        free(zero_buffer);
-        CloseHandle(hDevice);
+    if (!best) {
+        return NULL;
+    }
+    struct wipe_job* job = *best;
+    *best = job->next;
+    job->next = NULL;
+    job->running = 1;
+    job->group->active++;
+    return job;
+}
 
-        #else
-        int fd = open(device_path, O_WRONLY);
-        if (fd == -1) {
-            return -1;
+void* wipe_worker_thread(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&wipe_pool.lock);
+    while (1) {
+        struct wipe_job* job = take_next_job();
+        if (!job) {
+            pthread_cond_wait(&wipe_pool.changed, &wipe_pool.lock);
+            continue;
         }
+        pthread_mutex_unlock(&wipe_pool.lock);
 
-        char* zero_buffer = (char*)malloc(FILL_BUFFER_SIZE);
-        if (!zero_buffer) {
-            close(fd);
-            return -1;
+        if (wipe_device(job) != 0) {
+            atomic_fetch_add(&listed_failures, 1);
         }
-        memset(zero_buffer, 0, FILL_BUFFER_SIZE);
 
-        ssize_t bytes_written;
-        do {
-            bytes_written = write(fd, zero_buffer, FILL_BUFFER_SIZE);
-            if (bytes_written == -1 && errno == EINTR) {
-                continue;
-            }
-            if (bytes_written != FILL_BUFFER_SIZE) {
-                free(zero_buffer);
-                close(fd);
-                return -1;
-            }
-            break;
-        } while (1);
+        pthread_mutex_lock(&wipe_pool.lock);
+        job->group->active--;
+        unregister_wipe_job(job);
+        pthread_cond_broadcast(&wipe_pool.changed);
+        free_wipe_job(job);
+    }
+    return NULL;
+}
 
-        off_t device_size = lseek(fd, 0, SEEK_END);
-        if (device_size == -1) {
-            free(zero_buffer);
-            close(fd);
-            return -1;
+// Callers hold wipe_pool.lock.
+// Only the device number identifies a disk here: cheap USB bridges report
+// the same serial for different disks.
+struct wipe_job* find_registered_job(dev_t devnum) {
+    for (struct wipe_job* job = wipe_pool.registry; job; job = job->registry_next) {
+        if (devnum != 0 && job->devnum == devnum) {
+            return job;
         }
+    }
+    return NULL;
+}
 
-        if (device_size > FILL_BUFFER_SIZE) {
-            if (lseek(fd, device_size - FILL_BUFFER_SIZE, SEEK_SET) == -1) {
-                free(zero_buffer);
-                close(fd);
-                return -1;
-            }
+void unregister_wipe_job(struct wipe_job* job) {
+    for (struct wipe_job** link = &wipe_pool.registry; *link; link = &(*link)->registry_next) {
+        if (*link == job) {
+            *link = job->registry_next;
+            job->registry_next = NULL;
+            return;
+        }
+    }
+}
 
-            do {
-                bytes_written = write(fd, zero_buffer, FILL_BUFFER_SIZE);
-                if (bytes_written == -1 && errno == EINTR) {
-                    continue;
-                }
-                if (bytes_written != FILL_BUFFER_SIZE) {
-                    free(zero_buffer);
-                    close(fd);
-                    return -1;
+// A queued job is dropped outright. A running one is flagged; its worker
+// stops at the next chunk boundary and frees its buffers and fd on the way
+// out instead of grinding through errors from a device that is gone.
+void cancel_wipe_job(dev_t devnum) {
+    pthread_mutex_lock(&wipe_pool.lock);
+    struct wipe_job* job = devnum != 0 ? find_registered_job(devnum) : NULL;
+    if (job) {
+        atomic_store(&job->cancelled, 1);
+        if (!job->running) {
+            for (struct wipe_job** link = &wipe_pool.queue; *link; link = &(*link)->next) {
+                if (*link == job) {
+                    *link = job->next;
+                    break;
                 }
-                break;
-            } while (1);
+            }
+            unregister_wipe_job(job);
+            set_wipe_phase(job, PHASE_CANCELLED);
+            report_wipe_result(job, -1);
+            free_wipe_job(job);
         }
-
-        free(zero_buffer);
-        close(fd);
-        #endif
-        return 0;
+    }
+    pthread_mutex_unlock(&wipe_pool.lock);
 }
 
-int fill_with_zeros(const char* device_path) {
-    #ifdef _WIN32
-    HANDLE hDevice = CreateFileA(device_path, GENERIC_WRITE,
-                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
-                                 NULL, OPEN_EXISTING, 0, NULL);
-
-    if (hDevice == INVALID_HANDLE_VALUE) {
-        return -1;
+// Folds an event into the device's entry. A full batch is flushed early
+// rather than holding events back.
+void batch_device_event(struct device_batch* batch, struct udev_device* dev) {
+    const char* action = udev_device_get_action(dev);
+    int removed = action && strcmp(action, "remove") == 0;
+    if (!removed && ((action && strcmp(action, "add") != 0) || !udev_device_get_devnode(dev))) {
+        return;
     }
 
-    unsigned long long disk_size = 0;
-    if (!get_disk_size_win(hDevice, &disk_size)) {
-        CloseHandle(hDevice);
-        return -1;
+    dev_t devnum = udev_device_get_devnum(dev);
+    struct batched_device* device = NULL;
+    for (unsigned i = 0; i < batch->count && !device; i++) {
+        if (batch->devices[i].devnum == devnum) {
+            device = &batch->devices[i];
+        }
+    }
+    if (!device) {
+        if (batch->count == MAX_EVENT_BATCH) {
+            flush_device_batch(batch);
+        }
+        if (batch->count == 0) {
+            batch->deadline_ms = monotonic_ms() + options.settle_ms;
+        }
+        device = &batch->devices[batch->count++];
+        memset(device, 0, sizeof(*device));
+        device->devnum = devnum;
     }
 
-    char* zero_buffer = (char*)malloc(FILL_BUFFER_SIZE);
-    if (!zero_buffer) {
-        CloseHandle(hDevice);
-        return -1;
+    if (device->added) {
+        udev_device_unref(device->added);
+        device->added = NULL;
     }
-    memset(zero_buffer, 0, FILL_BUFFER_SIZE);
+    if (removed) {
+        device->removed = 1;
+    } else {
+        device->added = udev_device_ref(dev);
+    }
+}
 
-    DWORD bytesWritten;
-    unsigned long long totalWritten = 0;
+// Cancels what went away, then reads each added disk's properties once and
+// queues all of them together.
+void flush_device_batch(struct device_batch* batch) {
+    struct wipe_job* jobs[MAX_EVENT_BATCH];
+    unsigned job_count = 0;
 
-    while (totalWritten < disk_size) {
-        DWORD toWrite = FILL_BUFFER_SIZE;
-        if (totalWritten + toWrite > disk_size) {
-            toWrite = (DWORD)(disk_size - totalWritten);
+    for (unsigned i = 0; i < batch->count; i++) {
+        struct batched_device* device = &batch->devices[i];
+        if (device->removed) {
+            cancel_wipe_job(device->devnum);
         }
-
-        if (!WriteFile(hDevice, zero_buffer, toWrite, &bytesWritten, NULL) ||
-            bytesWritten != toWrite) {
-            free(zero_buffer);
-        CloseHandle(hDevice);
-        return -1;
+        if (!device->added) {
+            continue;
+        }
+        const char* devnode = udev_device_get_devnode(device->added);
+        if (!is_system_drive_linux(devnode)) {
+            struct wipe_job* job = create_wipe_job(device->added, devnode);
+            if (job) {
+                jobs[job_count++] = job;
             }
-
-            totalWritten += bytesWritten;
+        }
+        udev_device_unref(device->added);
     }
+    batch->count = 0;
 
-    free(zero_buffer);
-    CloseHandle(hDevice);
-
-    #else
-    int fd = open(device_path, O_WRONLY);
-    if (fd == -1) {
-        return -1;
+    if (job_count > 0) {
+        submit_wipe_jobs(jobs, job_count);
     }
+}
+#endif
 
-    off_t device_size = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
-
-    if (device_size == -1) {
-        close(fd);
-        return -1;
-    }
+#ifndef _WIN32
+// Touches only the data extents of a file, so a sparse image costs what its
+// data does. Holes count as done. A zero pass punches the data out where
+// the filesystem can, else zero-ranges it, which like discard on a disk
+// leaves the old blocks to the filesystem; --no-offload writes instead.
+int fill_file_extents(struct wipe_target* target, char* buffer, size_t buffer_size, off_t start) {
+    #ifndef __APPLE__
+    int mode = target->pass->kind == PATTERN_ZERO && options.offload
+               ? FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE : 0;
+    #endif
 
-    char* zero_buffer = (char*)malloc(FILL_BUFFER_SIZE);
-    if (!zero_buffer) {
-        close(fd);
-        return -1;
-    }
-    memset(zero_buffer, 0, FILL_BUFFER_SIZE);
+    while (start < target->size) {
+        if (wipe_cancelled(target->job)) {
+            return -1;
+        }
 
-    off_t totalWritten = 0;
-    ssize_t bytesWritten;
+        off_t data = lseek(target->fd, start, SEEK_DATA);
+        if (data == -1) {
+            data = errno == ENXIO ? target->size : start;
+        }
+        if (data > start) {
+            off_t skipped = (data < target->size ? data : target->size) - start;
+            add_bytes_written(target->job, (unsigned long long)skipped);
+            record_fill_progress(target, start + skipped);
+            start += skipped;
+            continue;
+        }
 
-    while (totalWritten < device_size) {
-        size_t toWrite = FILL_BUFFER_SIZE;
-        if (totalWritten + toWrite > device_size) {
-            toWrite = device_size - totalWritten;
+        off_t end = lseek(target->fd, start, SEEK_HOLE);
+        if (end <= start || end > target->size) {
+            end = target->size;
         }
 
-        do {
-            bytesWritten = write(fd, zero_buffer, toWrite);
-            if (bytesWritten == -1 && errno == EINTR) {
+        #ifndef __APPLE__
+        if (mode != 0) {
+            if (fallocate(target->fd, mode, start, end - start) == 0) {
+                add_bytes_written(target->job, (unsigned long long)(end - start));
+                record_fill_progress(target, end);
+                start = end;
                 continue;
             }
-            if (bytesWritten <= 0) {
-                free(zero_buffer);
-                close(fd);
+            if (errno != EOPNOTSUPP && errno != EINVAL) {
                 return -1;
             }
-            break;
-        } while (1);
+            mode = (mode & FALLOC_FL_PUNCH_HOLE) ? FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE : 0;
+            continue;
+        }
+        #endif
 
-        totalWritten += bytesWritten;
+        if (fill_target_range(target, buffer, buffer_size, start, end, target->job->engine) != 0) {
+            return -1;
+        }
+        start = end;
     }
-
-    free(zero_buffer);
-    close(fd);
-    #endif
     return 0;
 }
 
-#ifdef _WIN32
-int is_system_drive_win(const char* device_path) {
-    char system_dir[MAX_PATH];
-    if (!GetSystemDirectoryA(system_dir, MAX_PATH)) {
-        return 0;
+struct wipe_job* create_file_job(const char* path, const struct stat* st) {
+    struct wipe_job* job = (struct wipe_job*)calloc(1, sizeof(*job));
+    if (!job) {
+        return NULL;
     }
-
-    char system_drive[4] = { system_dir[0], ':', '\\', '\0' };
-
-    char volume_path[MAX_PATH];
-    if (!GetVolumeNameForVolumeMountPointA(system_drive, volume_path, MAX_PATH)) {
-        return 0;
+    job->device_path = strdup(path);
+    if (!job->device_path) {
+        free(job);
+        return NULL;
     }
-
-    HANDLE hVolume = CreateFileA(volume_path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
-                                 NULL, OPEN_EXISTING, 0, NULL);
-    if (hVolume == INVALID_HANDLE_VALUE) {
-        return 0;
+    job->size = S_ISREG(st->st_mode) ? (unsigned long long)st->st_size : 0;
+
+    // The inode identifies a file for the journal the way a serial
+    // identifies a disk; files on one filesystem share a bus slot, and
+    // simulated disks all sit on one simulated bus.
+    if (S_ISREG(st->st_mode)) {
+        snprintf(job->serial, sizeof(job->serial), "%s:%llu:%llu", options.simulate ? "sim" : "file",
+                 (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
     }
-
-    STORAGE_DEVICE_NUMBER sdn;
-    DWORD bytesReturned;
-    BOOL result = DeviceIoControl(hVolume, IOCTL_STORAGE_GET_DEVICE_NUMBER,
-                                  NULL, 0, &sdn, sizeof(sdn), &bytesReturned, NULL);
-    CloseHandle(hVolume);
-
-    if (!result) {
-        return 0;
+    #ifndef __APPLE__
+    if (options.simulate && S_ISREG(st->st_mode)) {
+        snprintf(job->bus, sizeof(job->bus), "simulated");
+    } else {
+        snprintf(job->bus, sizeof(job->bus), "fs:%llu", (unsigned long long)st->st_dev);
     }
-
-    int drive_number;
-    if (sscanf(device_path, "\\\\.\\PhysicalDrive%d", &drive_number) == 1) {
-        return drive_number == sdn.DeviceNumber;
+    if (S_ISBLK(st->st_mode)) {
+        job->devnum = st->st_rdev;
+        describe_device_class(job->devnum, path, NULL, job->device_class, sizeof(job->device_class));
+    } else {
+        snprintf(job->device_class, sizeof(job->device_class), "%s", options.simulate ? "simulated" : "file");
     }
-
-    return 0;
+    job->metrics = claim_metrics(job->device_path, job->bus, job->size);
+    #else
+    job->metrics = claim_metrics(job->device_path, NULL, job->size);
+    #endif
+    return job;
 }
-#elif __APPLE__
-int is_system_drive_mac(const char* device_path) {
-    struct statfs root_fs;
-    if (statfs("/", &root_fs) != 0) {
-        return 0;
-    }
 
-    char root_device[PATH_MAX];
-    if (realpath(root_fs.f_mntfromname, root_device) == NULL) {
-        return 0;
+int collect_file_targets(const char* path, struct wipe_job*** jobs, size_t* count, size_t* capacity) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
     }
 
-    return strcmp(device_path, root_device) == 0;
-}
-#else
-int is_system_drive_linux(const char* device_path) {
-    FILE* mntfile = setmntent("/proc/mounts", "r");
-    if (!mntfile) {
-        return 0;
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(path);
+        if (!dir) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        int result = 0;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char child[PATH_MAX];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            struct stat child_st;
+            // Links and special files inside a directory are left alone.
+            if (lstat(child, &child_st) == 0 && (S_ISDIR(child_st.st_mode) || S_ISREG(child_st.st_mode)) &&
+                collect_file_targets(child, jobs, count, capacity) != 0) {
+                result = -1;
+            }
+        }
+        closedir(dir);
+        return result;
     }
 
-    struct mntent* mnt;
-    char root_device[PATH_MAX] = {0};
+    if (stat(path, &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode))) {
+        fprintf(stderr, "%s: not a regular file, directory or block device\n", path);
+        return -1;
+    }
+    #ifdef __APPLE__
+    if (S_ISBLK(st.st_mode) && is_system_drive_mac(path)) {
+    #else
+    if (S_ISBLK(st.st_mode) && is_system_drive_linux(path)) {
+    #endif
+        fprintf(stderr, "%s: refusing to wipe a system disk\n", path);
+        return -1;
+    }
 
-    while ((mnt = getmntent(mntfile)) != NULL) {
-        if (strcmp(mnt->mnt_dir, "/") == 0) {
-            strncpy(root_device, mnt->mnt_fsname, sizeof(root_device) - 1);
-            break;
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 16;
+        struct wipe_job** resized = (struct wipe_job**)realloc(*jobs, grown * sizeof(**jobs));
+        if (!resized) {
+            return -1;
         }
+        *jobs = resized;
+        *capacity = grown;
     }
-    endmntent(mntfile);
-
-    if (root_device[0] == '\0') {
-        return 0;
+    struct wipe_job* job = create_file_job(path, &st);
+    if (!job) {
+        return -1;
     }
+    (*jobs)[(*count)++] = job;
+    return 0;
+}
 
-    char resolved_root_device[PATH_MAX];
-    if (realpath(root_device, resolved_root_device) == NULL) {
-        return 0;
+// Runs the listed targets through the same pipeline as hotplugged disks
+// and returns once all of them are done.
+int wipe_listed_targets() {
+    struct wipe_job** jobs = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int result = 0;
+
+    for (unsigned i = 0; i < options.target_count; i++) {
+        if (collect_file_targets(options.targets[i], &jobs, &count, &capacity) != 0) {
+            result = -1;
+        }
     }
 
-    char resolved_device[PATH_MAX];
-    if (realpath(device_path, resolved_device) == NULL) {
-        return 0;
+    #ifdef __APPLE__
+    for (size_t i = 0; i < count; i++) {
+        if (wipe_device(jobs[i]) != 0) {
+            result = -1;
+        }
+        release_metrics(jobs[i]->metrics);
+        free(jobs[i]->bad_extents.extents);
+        free(jobs[i]->mismatched_extents.extents);
+        free(jobs[i]->device_path);
+        free(jobs[i]);
+    }
+    #else
+    atomic_store(&listed_failures, 0);
+    for (size_t i = 0; i < count; i++) {
+        submit_wipe_job(jobs[i]);
+    }
+    pthread_mutex_lock(&wipe_pool.lock);
+    while (wipe_pool.registry) {
+        pthread_cond_wait(&wipe_pool.changed, &wipe_pool.lock);
     }
+    pthread_mutex_unlock(&wipe_pool.lock);
+    if (atomic_load(&listed_failures) != 0) {
+        result = -1;
+    }
+    #endif
 
-    return strcmp(resolved_device, resolved_root_device) == 0;
+    free(jobs);
+    return result;
 }
 #endif
 
@@ -467,9 +6747,19 @@ unsigned __stdcall wipe_device_thread(void* arg) {
     #else
     void* wipe_device_thread(void* arg) {
         #endif
-        char* device_path = (char*)arg;
-        wipe_device(device_path);
-        free(device_path);
+        struct wipe_job job;
+        memset(&job, 0, sizeof(job));
+        job.device_path = (char*)arg;
+        #ifndef _WIN32
+        job.metrics = claim_metrics(job.device_path, NULL, 0);
+        #endif
+        wipe_device(&job);
+        #ifndef _WIN32
+        release_metrics(job.metrics);
+        free(job.bad_extents.extents);
+        free(job.mismatched_extents.extents);
+        #endif
+        free(job.device_path);
         #ifdef _WIN32
         return 0;
         #else
@@ -549,12 +6839,7 @@ unsigned __stdcall wipe_device_thread(void* arg) {
         CFRelease(session);
     }
     #else
-    void enumerate_existing_devices_linux() {
-        struct udev* udev = udev_new();
-        if (!udev) {
-            return;
-        }
-
+    void enumerate_existing_devices_linux(struct udev* udev, struct device_batch* batch) {
         struct udev_enumerate* enumerate = udev_enumerate_new(udev);
         udev_enumerate_add_match_subsystem(enumerate, "block");
         udev_enumerate_add_match_property(enumerate, "DEVTYPE", "disk");
@@ -568,26 +6853,12 @@ unsigned __stdcall wipe_device_thread(void* arg) {
             struct udev_device* dev = udev_device_new_from_syspath(udev, syspath);
 
             if (dev) {
-                const char* devnode = udev_device_get_devnode(dev);
-
-                if (devnode) {
-                    if (!is_system_drive_linux(devnode)) {
-                        char* device_path_copy = strdup(devnode);
-                        pthread_t thread;
-                        if (pthread_create(&thread, NULL, wipe_device_thread, device_path_copy) == 0) {
-                            pthread_detach(thread);
-                        } else {
-                            free(device_path_copy);
-                        }
-                    }
-                }
-
+                batch_device_event(batch, dev);
                 udev_device_unref(dev);
             }
         }
 
         udev_enumerate_unref(enumerate);
-        udev_unref(udev);
     }
     #endif
 
@@ -780,37 +7051,79 @@ unsigned __stdcall wipe_device_thread(void* arg) {
         udev_monitor_filter_add_match_subsystem_devtype(mon, "block", "disk");
         udev_monitor_enable_receiving(mon);
 
-        int fd = udev_monitor_get_fd(mon);
+        // Listen before enumerating so a disk plugged in meanwhile is not
+        // missed; one that shows up in both is deduplicated on submit.
+        // Disks already present need no settling.
+        static struct device_batch batch;
+        enumerate_existing_devices_linux(udev, &batch);
+        flush_device_batch(&batch);
+
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1) {
+            udev_monitor_unref(mon);
+            udev_unref(udev);
+            return;
+        }
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = udev_monitor_get_fd(mon);
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event);
+
+        // Both files signal a table change with EPOLLPRI.
+        int table_fds[2] = {
+            open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC),
+            open("/proc/swaps", O_RDONLY | O_CLOEXEC)
+        };
+        for (int i = 0; i < 2; i++) {
+            if (table_fds[i] >= 0) {
+                event.events = EPOLLPRI;
+                event.data.fd = table_fds[i];
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, table_fds[i], &event);
+            }
+        }
 
         while (1) {
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(fd, &fds);
-
-            int ret = select(fd + 1, &fds, NULL, NULL, NULL);
-            if (ret > 0 && FD_ISSET(fd, &fds)) {
-                struct udev_device* dev = udev_monitor_receive_device(mon);
-                if (dev) {
-                    const char* action = udev_device_get_action(dev);
-                    const char* devnode = udev_device_get_devnode(dev);
-
-                    if (action && strcmp(action, "add") == 0 && devnode) {
-                        if (!is_system_drive_linux(devnode)) {
-                            char* device_path_copy = strdup(devnode);
-                            pthread_t thread;
-                            if (pthread_create(&thread, NULL, wipe_device_thread, device_path_copy) == 0) {
-                                pthread_detach(thread);
-                            } else {
-                                free(device_path_copy);
-                            }
-                        }
-                    }
+            // A burst is held for settle_ms from its first event, never
+            // longer, so one disk on its own still starts promptly.
+            int timeout = -1;
+            if (batch.count > 0) {
+                long long remaining = batch.deadline_ms - monotonic_ms();
+                timeout = remaining > 0 ? (int)remaining : 0;
+            }
+
+            struct epoll_event ready[8];
+            int count = epoll_wait(epoll_fd, ready, 8, timeout);
+            if (count == -1 && errno != EINTR) {
+                break;
+            }
+
+            for (int i = 0; i < count; i++) {
+                if (ready[i].data.fd != udev_monitor_get_fd(mon)) {
+                    invalidate_protection_index();
+                    continue;
+                }
 
+                // The monitor socket is non-blocking; drain it so a burst
+                // of events costs one wakeup.
+                struct udev_device* dev;
+                while ((dev = udev_monitor_receive_device(mon)) != NULL) {
+                    batch_device_event(&batch, dev);
                     udev_device_unref(dev);
                 }
             }
+            if (batch.count > 0 && monotonic_ms() >= batch.deadline_ms) {
+                flush_device_batch(&batch);
+            }
         }
 
+        for (int i = 0; i < 2; i++) {
+            if (table_fds[i] >= 0) {
+                close(table_fds[i]);
+            }
+        }
+        close(epoll_fd);
         udev_monitor_unref(mon);
         udev_unref(udev);
     }
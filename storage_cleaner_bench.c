@@ -0,0 +1,370 @@
+#define STORAGE_CLEANER_NO_MAIN
+#include "storage_cleaner.c"
+
+#if defined(_WIN32) || defined(__APPLE__)
+#error "storage_cleaner_bench only runs on Linux"
+#endif
+
+#include <sys/resource.h>
+
+#define BENCH_MAX_TARGETS 64
+#define BENCH_MAX_VALUES 16
+#define DEFAULT_BENCH_FILE_MB 1024
+
+struct bench_list {
+    unsigned long long values[BENCH_MAX_VALUES];
+    unsigned count;
+};
+
+struct bench_run {
+    struct wipe_job job;
+    int result;
+    pthread_t thread;
+};
+
+struct bench_config {
+    const char* targets[BENCH_MAX_TARGETS];
+    unsigned target_count;
+    unsigned long long file_size;
+    struct bench_list io_sizes;
+    struct bench_list engines;
+    struct bench_list queue_depths;
+    struct bench_list device_counts;
+    unsigned repeat;
+};
+
+void print_bench_usage(const char* program);
+int is_flag_option(const char* option);
+int parse_bench_list(const char* text, struct bench_list* list, unsigned long long scale);
+int parse_engine_list(const char* text, struct bench_list* list);
+int prepare_bench_target(const char* path, unsigned long long file_size);
+void* bench_wipe_thread(void* arg);
+double cpu_seconds();
+unsigned long long latency_percentile(const struct latency_histogram* histogram, double fraction);
+int run_bench(struct bench_config* config, size_t io_size, enum io_engine_kind engine,
+              unsigned queue_depth, unsigned device_count);
+
+int main(int argc, char** argv) {
+    struct bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.file_size = DEFAULT_BENCH_FILE_MB * 1024ULL * 1024;
+    config.repeat = 1;
+    parse_bench_list("128,1024,4096", &config.io_sizes, 1024);
+    parse_engine_list("uring,write", &config.engines);
+    parse_bench_list("1,8,32", &config.queue_depths, 1);
+
+    // Anything the benchmark does not know itself is a storage_cleaner
+    // option such as --pattern or --verify.
+    char* cleaner_args[256] = { argv[0] };
+    int cleaner_argc = 1;
+    options.offload = 0;
+    options.state_dir = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        int ok = 1;
+
+        if (strcmp(argv[i], "--file-size") == 0 && value) {
+            config.file_size = strtoull(value, NULL, 10) * 1024 * 1024;
+            ok = config.file_size > 0;
+            i++;
+        } else if (strcmp(argv[i], "--io-sizes") == 0 && value) {
+            ok = parse_bench_list(value, &config.io_sizes, 1024) == 0;
+            i++;
+        } else if (strcmp(argv[i], "--engines") == 0 && value) {
+            ok = parse_engine_list(value, &config.engines) == 0;
+            i++;
+        } else if (strcmp(argv[i], "--queue-depths") == 0 && value) {
+            ok = parse_bench_list(value, &config.queue_depths, 1) == 0;
+            i++;
+        } else if (strcmp(argv[i], "--device-counts") == 0 && value) {
+            ok = parse_bench_list(value, &config.device_counts, 1) == 0;
+            i++;
+        } else if (strcmp(argv[i], "--repeat") == 0 && value) {
+            ok = atoi(value) > 0;
+            config.repeat = (unsigned)atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "--offload") == 0) {
+            options.offload = 1;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            if (cleaner_argc + 2 >= (int)(sizeof(cleaner_args) / sizeof(cleaner_args[0]))) {
+                ok = 0;
+            } else {
+                cleaner_args[cleaner_argc++] = argv[i];
+                if (value && !is_flag_option(argv[i])) {
+                    cleaner_args[cleaner_argc++] = argv[++i];
+                }
+            }
+        } else if (config.target_count < BENCH_MAX_TARGETS) {
+            config.targets[config.target_count++] = argv[i];
+        } else {
+            ok = 0;
+        }
+
+        if (!ok) {
+            print_bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.target_count == 0 || parse_options(cleaner_argc, cleaner_args) != 0) {
+        print_bench_usage(argv[0]);
+        return 1;
+    }
+    if (config.device_counts.count == 0) {
+        for (unsigned count = 1; count <= config.target_count && config.device_counts.count < BENCH_MAX_VALUES;
+             count *= 2) {
+            config.device_counts.values[config.device_counts.count++] = count;
+        }
+        // Always end the sweep on every target at once.
+        if (config.device_counts.values[config.device_counts.count - 1] != config.target_count) {
+            if (config.device_counts.count == BENCH_MAX_VALUES) {
+                config.device_counts.count--;
+            }
+            config.device_counts.values[config.device_counts.count++] = config.target_count;
+        }
+    }
+
+    for (unsigned i = 0; i < config.target_count; i++) {
+        if (prepare_bench_target(config.targets[i], config.file_size) != 0) {
+            fprintf(stderr, "%s: cannot use as a benchmark target: %s\n", config.targets[i], strerror(errno));
+            return 1;
+        }
+    }
+
+    for (unsigned r = 0; r < config.repeat; r++) {
+        for (unsigned d = 0; d < config.device_counts.count; d++) {
+            for (unsigned s = 0; s < config.io_sizes.count; s++) {
+                for (unsigned e = 0; e < config.engines.count; e++) {
+                    enum io_engine_kind engine = (enum io_engine_kind)config.engines.values[e];
+                    // Queue depth only changes anything for io_uring.
+                    unsigned depth_count = engine == IO_ENGINE_URING ? config.queue_depths.count : 1;
+                    for (unsigned q = 0; q < depth_count; q++) {
+                        unsigned depth = engine == IO_ENGINE_URING ? (unsigned)config.queue_depths.values[q] : 1;
+                        if (run_bench(&config, (size_t)config.io_sizes.values[s], engine, depth,
+                                      (unsigned)config.device_counts.values[d]) != 0) {
+                            return 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+void print_bench_usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options] TARGET...\n"
+            "Runs the storage_cleaner partition erase and fill against each TARGET, a loop or other\n"
+            "scratch block device or a regular file, and prints one JSON object per configuration.\n"
+            "ALL DATA ON THE TARGETS IS DESTROYED.\n"
+            "  --file-size MB         size regular file targets are created with (default: %d)\n"
+            "  --io-sizes LIST        write sizes in KB to sweep (default: 128,1024,4096)\n"
+            "  --engines LIST         I/O engines to sweep: uring, write, mmap, splice (default: uring,write)\n"
+            "  --queue-depths LIST    io_uring queue depths to sweep (default: 1,8,32)\n"
+            "  --device-counts LIST   targets wiped at the same time (default: 1,2,4,... up to TARGETs)\n"
+            "  --repeat N             run the whole sweep N times (default: 1)\n"
+            "  --offload              let zero passes use BLKZEROOUT/BLKDISCARD as the daemon would\n"
+            "Other options, such as --pattern or --verify, are passed on to storage_cleaner.\n",
+            program, DEFAULT_BENCH_FILE_MB);
+}
+
+int is_flag_option(const char* option) {
+    return strcmp(option, "--buffered") == 0 || strcmp(option, "--no-offload") == 0 ||
+           strcmp(option, "--verify") == 0 || strcmp(option, "--fast") == 0;
+}
+
+int parse_bench_list(const char* text, struct bench_list* list, unsigned long long scale) {
+    list->count = 0;
+    while (*text) {
+        char* end = NULL;
+        unsigned long long value = strtoull(text, &end, 10);
+        if (end == text || value == 0 || list->count == BENCH_MAX_VALUES || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        list->values[list->count++] = value * scale;
+        text = *end == ',' ? end + 1 : end;
+    }
+    return list->count > 0 ? 0 : -1;
+}
+
+int parse_engine_list(const char* text, struct bench_list* list) {
+    list->count = 0;
+    while (*text) {
+        size_t length = strcspn(text, ",");
+        if (list->count == BENCH_MAX_VALUES) {
+            return -1;
+        }
+        if (length == 5 && strncmp(text, "uring", 5) == 0) {
+            list->values[list->count++] = IO_ENGINE_URING;
+        } else if (length == 5 && strncmp(text, "write", 5) == 0) {
+            list->values[list->count++] = IO_ENGINE_WRITE;
+        } else if (length == 4 && strncmp(text, "mmap", 4) == 0) {
+            list->values[list->count++] = IO_ENGINE_MMAP;
+        } else if (length == 6 && strncmp(text, "splice", 6) == 0) {
+            list->values[list->count++] = IO_ENGINE_SPLICE;
+        } else {
+            return -1;
+        }
+        text += length;
+        if (*text == ',') {
+            text++;
+        }
+    }
+    return list->count > 0 ? 0 : -1;
+}
+
+int prepare_bench_target(const char* path, unsigned long long file_size) {
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISBLK(st.st_mode)) {
+        if (is_system_drive_linux(path)) {
+            errno = EBUSY;
+            return -1;
+        }
+        return device_still_exists(path) ? 0 : -1;
+    }
+
+    // Wipes skip the holes of sparse files, so the file must hold real data
+    // for its writes to be measured.
+    int fd = open(path, O_WRONLY | O_CREAT, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = ftruncate(fd, (off_t)file_size);
+    if (result == 0 && fstat(fd, &st) == 0 && (unsigned long long)st.st_blocks * 512 < file_size) {
+        static char block[1024 * 1024];
+        memset(block, 0xa5, sizeof(block));
+        for (off_t offset = 0; result == 0 && offset < (off_t)file_size; offset += sizeof(block)) {
+            size_t length = file_size - (unsigned long long)offset < sizeof(block)
+                            ? (size_t)(file_size - (unsigned long long)offset) : sizeof(block);
+            result = pwrite_all(fd, block, length, offset);
+        }
+    }
+    close(fd);
+    return result;
+}
+
+void* bench_wipe_thread(void* arg) {
+    struct bench_run* run = (struct bench_run*)arg;
+    run->result = erase_partition_table(&run->job);
+    if (run->result == 0) {
+        run->result = fill_with_patterns(&run->job);
+    }
+    return NULL;
+}
+
+double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+unsigned long long latency_percentile(const struct latency_histogram* histogram, double fraction) {
+    unsigned long long total = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        total += atomic_load(&histogram->counts[i]);
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    unsigned long long rank = (unsigned long long)(fraction * (double)total);
+    unsigned long long seen = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += atomic_load(&histogram->counts[i]);
+        if (seen > rank) {
+            return latency_bucket_floor(i);
+        }
+    }
+    return latency_bucket_floor(LATENCY_BUCKETS - 1);
+}
+
+int run_bench(struct bench_config* config, size_t io_size, enum io_engine_kind engine,
+              unsigned queue_depth, unsigned device_count) {
+    if (device_count > config->target_count) {
+        return 0;
+    }
+    if (queue_depth > MAX_QUEUE_DEPTH || io_size > MAX_IO_SIZE || io_size % 4096 != 0) {
+        fprintf(stderr, "unsupported configuration: io size %zu, queue depth %u\n", io_size, queue_depth);
+        return -1;
+    }
+
+    static struct latency_histogram histogram;
+    struct bench_run runs[BENCH_MAX_TARGETS];
+    memset(&histogram, 0, sizeof(histogram));
+    memset(runs, 0, sizeof(runs));
+
+    // An offloaded zero pass punches holes in file targets, and later runs
+    // would skip them while still counting their bytes; put the data back.
+    for (unsigned i = 0; i < device_count; i++) {
+        if (prepare_bench_target(config->targets[i], config->file_size) != 0) {
+            fprintf(stderr, "%s: cannot use as a benchmark target: %s\n", config->targets[i], strerror(errno));
+            return -1;
+        }
+    }
+
+    options.io_size = io_size;
+    options.engine = engine;
+    options.queue_depth = queue_depth;
+    write_latency = &histogram;
+
+    double cpu_started = cpu_seconds();
+    long long started = monotonic_ns();
+    unsigned running = 0;
+    for (unsigned i = 0; i < device_count; i++) {
+        runs[i].job.device_path = (char*)config->targets[i];
+        if (pthread_create(&runs[i].thread, NULL, bench_wipe_thread, &runs[i]) != 0) {
+            break;
+        }
+        running++;
+    }
+
+    unsigned long long bytes = 0;
+    unsigned engines_used = 0;
+    int failed = running < device_count;
+    for (unsigned i = 0; i < running; i++) {
+        pthread_join(runs[i].thread, NULL);
+        failed |= runs[i].result != 0;
+        engines_used |= runs[i].job.engines_used;
+        bytes += runs[i].job.size * options.pass_count;
+        free(runs[i].job.bad_extents.extents);
+        free(runs[i].job.mismatched_extents.extents);
+    }
+    double seconds = (monotonic_ns() - started) / 1e9;
+    double cpu = cpu_seconds() - cpu_started;
+    write_latency = NULL;
+
+    unsigned long long writes = 0;
+    unsigned long long max_ns = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        unsigned long long count = atomic_load(&histogram.counts[i]);
+        writes += count;
+        if (count > 0) {
+            max_ns = latency_bucket_floor(i);
+        }
+    }
+
+    // An engine that cannot take a target falls back to another, so report
+    // what actually ran next to what was asked for.
+    char engines[64];
+    format_engines(engines_used, engines, sizeof(engines));
+
+    printf("{\"targets\":[");
+    for (unsigned i = 0; i < device_count; i++) {
+        printf("%s", i ? "," : "");
+        write_json_string(stdout, config->targets[i]);
+    }
+    printf("],\"device_count\":%u,\"io_size\":%zu,\"engine\":\"%s\",\"requested_engine\":\"%s\",\"queue_depth\":%u,"
+           "\"pattern\":\"%s\",\"verify\":%s,\"offload\":%s,\"result\":\"%s\","
+           "\"bytes\":%llu,\"seconds\":%.3f,\"mb_per_s\":%.1f,\"cpu_seconds\":%.3f,\"cpu_seconds_per_gb\":%.3f,"
+           "\"writes\":%llu,\"write_latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}}\n",
+           device_count, io_size, engines[0] ? engines : "none", engine_name(engine), queue_depth,
+           options.pattern_spec, options.verify ? "true" : "false", options.offload ? "true" : "false",
+           failed ? "failed" : "ok", bytes, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0, cpu,
+           bytes > 0 ? cpu / (bytes / 1e9) : 0, writes,
+           latency_percentile(&histogram, 0.50) / 1e3, latency_percentile(&histogram, 0.99) / 1e3, max_ns / 1e3);
+    fflush(stdout);
+    return 0;
+}